@@ -40,41 +40,203 @@
  *   daemon rather than managing memory and cpu offlining directly. While the daemon is in
  *   operation, it waits for input on the named pipe, consuming no cpu resources, and
  *   and insignificant memory other than the locked DRAM blocks requested.
+ *   Clients that need to know when a target has been reached use the control socket,
+ *   /tmp/wastebin.sock, instead: 'wastebin -w' waits for the daemon's answer and
+ *   'wastebin -q' asks for its current state.
+ *   The daemon also publishes its progress in a shared status page, /tmp/wastebin.stat,
+ *   that monitors can map and poll at no cost to the daemon ('wastebin -s' reads it).
  *   The wasted memory pages are all zero (mlock creates zero pages), which a smart
  *   hypervisor (like the TidalScale hyperkernel) might optimize away, recreating them
- *   when accessed by the Linux kernel or application guest.
+ *   when accessed by the Linux kernel or application guest. Where that, KSM or a
+ *   compressing swap would make the waste cheaper than real use, -F fills the
+ *   pages with a pattern or with random content instead.
  * Usage:
  *   The command usage is shown by typing 'wastebin -h'. It takes two numeric arguments,
  *   the amount of memory (in various units of bytes, K bytes, M byte, G bytes, and T bytes)
  *   and the number of cpus that should be taken out of service by the program.
  *   It must be executed with root privileges to take cpus offline, via sudo.
+ *   Options, listed by 'wastebin -h', precede the arguments. Options that shape the
+ *   daemon (such as -j, the number of threads used to lock memory) take effect when
+ *   the invocation is the one that starts the daemon.
  *   'wastebin 0 0' will restore the system to full operation, and terminate any daemon
  *   instance that may exist.
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <locale.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <poll.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <regex.h>
+#include <dirent.h>
+#include <sys/mount.h>
+#include <linux/mempolicy.h>
 
 static void usage_exit(int ec, char *cmdstr)
 {
 	FILE *fh = (ec == EXIT_SUCCESS) ? stdout : stderr;
 	fprintf(fh, "Usage:\n"
 	       " %s -h\n"
-	       " %s <mem> [<ncpus>]\n"
-	       "  where <ncpus> is number of cpus to disable (default is 0) and\n"
+	       " %s [options] <mem> [<ncpus>]\n"
+	       " %s -S <schedule> [options] [<mem> [<ncpus>]]\n"
+	       " %s [options] sweep [<sweep options>] [--] <command> [<args>]\n"
+	       " %s [options] bench [<bench options>]\n"
+	       " %s [options] agent [-l [<addr>:]<port>] [-k <file>]\n"
+	       " %s fleet -H <hosts> [<fleet options>] <mem> [<ncpus>] [-- <command> [<args>]]\n"
+	       " %s decode [-f <fmt>] <file>...\n"
+	       " %s -q\n"
+	       " %s -x\n"
+	       "  where <ncpus> is number of cpus to disable (default is 0), or a list of\n"
+	       "        the cpus to disable such as 4-7,12 (a single cpu N is N-N). It may\n"
+	       "        be followed by +<k>x<f> to also use <k> more cpus each for a fraction\n"
+	       "        <f> of the time, and <n>.<d> is short for <n>+1x0.<d>.\n"
 	       "        <mem> is amount of memory to disable (required, may be 0).\n"
 	       "              Suffix indicates units, case-insensitive, either K, M, G, T,\n"
-	       "              for KiB, MiB, GiB, TiB\n",
-		cmdstr, cmdstr);
+	       "              for KiB, MiB, GiB, TiB. <mem>@<node>[,<mem>@<node>...]\n"
+	       "              wastes memory on the given NUMA nodes, <mem>@all spreads\n"
+	       "              <mem> over the nodes in proportion to their size\n"
+	       "              avail:<size> takes memory as needed to hold MemAvailable at\n"
+	       "              <size>, psi:<pct> to hold memory pressure (some avg10) at or\n"
+	       "              under <pct> percent, while the background process runs\n"
+	       "        Either may also be <pct>%% of what could be taken, leave:<amount>\n"
+	       "        to leave only <amount>, such as leave:64G or leave:8cpus, or\n"
+	       "        +<amount> and -<amount> to change the current target (put -- before\n"
+	       "        a <mem> of -<amount>), worked out by the background process\n"
+	       " Options:\n"
+	       "  -w, --wait         wait until the target is reached, then show the state\n"
+	       "  -q, --query        show the state of the background process\n"
+	       "  -x, --exit         ask the background process to give back everything and\n"
+	       "                     exit, even when persistent\n"
+	       "  -s, --status       show the state published in /tmp/wastebin.stat, without\n"
+	       "                     involving the background process\n"
+	       "  -a, --audit        after adjusting, check with mincore() that exactly the\n"
+	       "                     wasted memory is resident (slow on large machines)\n"
+	       "  -L, --cache=<llc>  also take last level cache from all other tasks with\n"
+	       "                     resctrl, <llc> is a size or <n>w for <n> cache ways\n"
+	       "  -B, --bandwidth=<pct>  also take <pct> percent of the memory bandwidth,\n"
+	       "                     with resctrl MBA, or else with streaming threads on the\n"
+	       "                     taken cpus of --cpu-backend=cpuset, whose buffers are\n"
+	       "                     part of the memory taken\n"
+	       " Options honored by the invocation that starts the background process:\n"
+	       "  -j, --threads=<n>  lock memory from <n> threads, each pinned to a cpu that\n"
+	       "                     is not taken (default 1)\n"
+	       "  -C, --chunk=<size> lock memory <size> at a time, such as 1G (default is by\n"
+	       "                     the amount, from 64 MiB to 1 GiB), and release it <size>\n"
+	       "                     at a time (default 1 GiB). Progress is logged and new\n"
+	       "                     requests are looked for between chunks\n"
+	       "  -R, --release=<mode>  discard released memory with madvise, <mode> is\n"
+	       "                     dontneed (the default), free for MADV_FREE, or remove\n"
+	       "                     for MADV_REMOVE on a shared mapping of the region\n"
+	       "  -A, --async-release  only unlock released memory and discard it on a\n"
+	       "                     background thread, while cpus change\n"
+	       "  -M, --memfd        back wasted memory with a memfd, allocated with fallocate\n"
+	       "                     and released by punching holes\n"
+	       "  -X, --takeover     replace the running background process, taking over the\n"
+	       "                     memory in its memfd (implies -M)\n"
+	       "  -P, --persistent   keep running when nothing is taken, until asked to exit\n"
+	       "                     with -x, SIGTERM or SIGINT\n"
+	       "  -f, --foreground   don't fork, run the background process in the foreground\n"
+	       "                     logging to stdout, and notify systemd when ready\n"
+	       "  -H, --huge=<mode>  back wasted memory with huge pages, <mode> is thp for\n"
+	       "                     transparent 2 MiB pages, 2M or 1G for hugetlbfs pages\n"
+	       "  -N, --numa         bind wasted memory to NUMA nodes, spreading a plain <mem>\n"
+	       "                     over them (implied by <mem>@<node> and <mem>@all)\n"
+	       "  -c, --cpu-policy=<policy>  choose the cpus to disable by topology, one of\n"
+	       "                     highest (highest numbered first, the default), cores\n"
+	       "                     (whole cores), smt (second threads of every core first),\n"
+	       "                     spread (whole cores evenly across sockets) or socket\n"
+	       "                     (empty the highest socket first)\n"
+	       "  -p, --hotplug-threads=<n>  change the online state of up to <n> cpus at a\n"
+	       "                     time (default 1)\n"
+	       "  -b, --cpu-backend=<backend>  how cpus are taken, hotplug (the default) takes\n"
+	       "                     them offline, cpuset moves them to an isolated cgroup v2\n"
+	       "                     partition and cpuset:<cgroup> removes them from the\n"
+	       "                     cpuset of only that cgroup\n"
+	       "  -m, --mem-backend=<backend>  how memory is taken, mlock (the default) locks\n"
+	       "                     it, offline takes whole memory blocks offline, movable\n"
+	       "                     ones first, and locks the remainder, cgroup:<cgroup>\n"
+	       "                     lowers the memory.max of only that cgroup v2 subtree,\n"
+	       "                     and cgroup-high:<cgroup> its memory.high. Percentages\n"
+	       "                     and setpoints are then of that cgroup\n"
+	       "  -F, --fill=<mode>  fill wasted pages as they are locked, <mode> is zero (the\n"
+	       "                     default, pages are left as the kernel zeroed them),\n"
+	       "                     pattern[:<hex>] for a repeated 64 bit word or random\n"
+	       "                     for content that can't be compressed or merged\n"
+	       "  -T, --trace=<file> write a CSV timeline of reclaim, swap, compaction and\n"
+	       "                     memory pressure during each adjustment to <file>\n"
+	       "  -I, --trace-interval=<ms>  sample the trace every <ms> (default 100)\n"
+	       "  -E, --events=<file>  log each adjustment step as binary records to <file>,\n"
+	       "                     printed by 'wastebin decode'\n"
+	       "  -Z, --events-size=<size>  move the event log to <file>.1 and start a new\n"
+	       "                     one when it grows past <size> (default 64M, 0 never)\n"
+	       "  -S, --schedule=<schedule>  step through targets at set times, <schedule> is\n"
+	       "                     clauses such as 'mem 0..256G step 16G every 60s' and\n"
+	       "                     'cpus 0..8 step 1 every 120s' separated by ';', or\n"
+	       "                     @<file> with a clause per line. Quantities without a\n"
+	       "                     ramp stay at <mem> and <ncpus>. A request ends it\n"
+	       " Sweep options, for running <command> at each point of a grid of targets:\n"
+	       "  -m, --mem=<points>  memory to take, such as 0,16G,32G or 0..64G step 16G\n"
+	       "  -c, --cpus=<points> cpus to take, as a list or range like the memory\n"
+	       "  -M, --metric=<regex>  find the throughput in the command's output, in the\n"
+	       "                     first subexpression of the last match (default is to\n"
+	       "                     compare wall times)\n"
+	       "  -l, --lower        the metric is better when lower, like a time\n"
+	       "  -t, --tolerance=<pct>  the knee is the point taking the most cpus, then\n"
+	       "                     memory, within <pct> of the full machine (default 5)\n"
+	       "  -f, --format=<fmt> write results as csv (the default) or json\n"
+	       "  -o, --output=<file>  write results to <file> instead of standard output\n"
+	       " Bench options, for timing locking, mincore, releasing and hotplug here:\n"
+	       "  -s, --size=<size>  lock <size> at a time (default 1G, at most half of\n"
+	       "                     MemAvailable)\n"
+	       "  -r, --repeat=<n>   report the median of <n> runs (default 3)\n"
+	       "  -p, --hotplug      also take each cpu offline and back online\n"
+	       "  -f, --format=<fmt> write results as csv (the default) or json\n"
+	       "  -o, --output=<file>  write results to <file> instead of standard output\n"
+	       " Agent options, for serving a fleet controller over TCP:\n"
+	       "  -l, --listen=[<addr>:]<port>  listen on <port> (default 7970) of loopback, or\n"
+	       "                     of <addr>, [<ipv6>] or * for all, starting a persistent\n"
+	       "                     background process with the options before 'agent'\n"
+	       "                     when one is needed\n"
+	       "  -k, --key=<file>   only serve controllers that send the key in the first\n"
+	       "                     line of <file>, required beyond loopback\n"
+	       " Fleet options, for setting the same target on many hosts at once:\n"
+	       "  -H, --hosts=<hosts>  agents to drive, <host>[:<port>],... or @<file> with\n"
+	       "                     a host per line. <command> runs once all of them have\n"
+	       "                     reached the target\n"
+	       "  -k, --key=<file>   authenticate to the agents with the key in <file>\n"
+	       "  -t, --timeout=<duration>  give up on a host that doesn't answer in time\n"
+	       "                     (default 600s)\n"
+	       "  -r, --restore      give everything back on every host afterwards\n"
+	       "  -f, --format=<fmt> write each host's state as csv (the default) or json\n"
+	       "  -o, --output=<file>  write the states to <file> instead of standard output\n"
+	       " Decode options, for printing event logs written with -E:\n"
+	       "  -f, --format=<fmt> write events as csv (the default) or json, one object\n"
+	       "                     per line\n",
+		cmdstr, cmdstr, cmdstr, cmdstr, cmdstr, cmdstr, cmdstr, cmdstr, cmdstr, cmdstr);
 	fflush(fh);
 	exit(ec);
 }
@@ -130,251 +292,5283 @@ static long int strm2ul(char *arg)
 	return -1;
 }
 
+/* write a string to a sysfs or cgroup file, returns 0 or -1 with errno set */
+static int write_file(const char *path, const char *value)
+{
+	ssize_t nb;
+	int fh, err;
+
+	fh = open(path, O_WRONLY);
+	if (fh < 0)
+		return -1;
+	nb = write(fh, value, strlen(value));
+	err = errno;
+	close(fh);
+	errno = err;
+	return nb == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+/* read the first line of a file without its newline, returns 0 or -1 */
+static int read_file(const char *path, char *buf, size_t len)
+{
+	ssize_t nb;
+	int fh;
+
+	fh = open(path, O_RDONLY);
+	if (fh < 0)
+		return -1;
+	nb = read(fh, buf, len - 1);
+	close(fh);
+	if (nb < 0)
+		return -1;
+	buf[nb] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/* read a number from a sysfs file named by a format, -1 if it can't be read */
+static long read_sysfs_long(const char *fmt, ...)
+{
+	char sysfile[128];
+	va_list ap;
+	FILE *fh;
+	long value = -1;
+
+	va_start(ap, fmt);
+	vsnprintf(sysfile, sizeof(sysfile), fmt, ap);
+	va_end(ap);
+	fh = fopen(sysfile, "r");
+	if (fh == NULL)
+		return -1;
+	if (fscanf(fh, "%ld", &value) != 1)
+		value = -1;
+	fclose(fh);
+	return value;
+}
+
 static ssize_t wastebin_max_size;     /* maximum size of memory that can be wasted */
+static ssize_t wastebin_mem_max;      /* what memory targets are out of */
 static ssize_t wastebin_memory_taken = 0;
+static size_t wastebin_memory_offline = 0;	/* in memory blocks taken offline */
+static size_t wastebin_memory_limited = 0;	/* by lowering a cgroup's limit */
+static size_t wastebin_memory_streaming = 0;	/* in the bandwidth streamers' buffers */
 static char *wastebin_memory;	      /* segment that can hold enormous mem */
 
-#define max_cpu_count 4096
-static char cpus_online[max_cpu_count] = { 0 };
-static char cpus_taken[max_cpu_count] = { 0 };
-static unsigned wastebin_cpus_taken = 0;
-static void set_cpu_online_state(unsigned cpu, char online_state)
+/* all the memory taken, however it is taken */
+static size_t memory_wasted(void)
+{
+	return wastebin_memory_taken + wastebin_memory_offline + wastebin_memory_limited +
+		wastebin_memory_streaming;
+}
+
+/*
+ * Huge page backing (-H). By default the waste region is made of 4 KiB pages, so
+ * every GiB wasted costs 262,144 page faults and as many page table entries.
+ * "thp" asks for transparent 2 MiB pages in the anonymous region, while "2M" and
+ * "1G" map the region from the hugetlbfs pool, which must have been sized with
+ * /proc/sys/vm/nr_hugepages (or nr_overcommit_hugepages) beforehand.
+ * Memory is locked and released in steps of wastebin_page_size.
+ */
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+enum huge_mode { HUGE_NONE, HUGE_THP, HUGE_2M, HUGE_1G };
+static enum huge_mode wastebin_huge = HUGE_NONE;
+static size_t wastebin_page_size = 1UL << 12;
+static int wastebin_map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_NONBLOCK;
+/*
+ * memfd backing (-M). Instead of anonymous memory the region may be a shared
+ * mapping of a memfd, of hugetlb pages when asked for 2M or 1G. Each chunk is
+ * then allocated with fallocate() before it is locked, so the kernel zeroes
+ * pages in bulk and mlock only maps them, and released memory is punched out of
+ * the file. With --numa, hugetlb chunks are faulted in by mlock instead, since
+ * fallocate on hugetlbfs doesn't follow the binding of the mapping. The memfd
+ * can also be handed over to a new daemon (-X), with its pages intact.
+ */
+#ifndef MFD_HUGE_2MB
+#define MFD_HUGE_2MB MAP_HUGE_2MB
+#define MFD_HUGE_1GB MAP_HUGE_1GB
+#endif
+static int wastebin_use_memfd = 0;	/* -M option */
+static int wastebin_memfd = -1;
+static int memfd_fallocate = 0;		/* chunks are allocated with fallocate */
+/* how released memory is discarded, see release_memory() */
+enum release_mode { RELEASE_DONTNEED, RELEASE_FREE, RELEASE_REMOVE };
+static const char *release_names[] = { "dontneed", "free", "remove" };
+static enum release_mode wastebin_release = RELEASE_DONTNEED;
+static int release_async = 0;		/* -A option */
+
+static int parse_huge_mode(char *arg)
+{
+	if (strcasecmp(arg, "thp") == 0)
+		return HUGE_THP;
+	if (strcasecmp(arg, "2m") == 0)
+		return HUGE_2M;
+	if (strcasecmp(arg, "1g") == 0)
+		return HUGE_1G;
+	return -1;
+}
+
+static size_t round_to_page(size_t bytes)
+{
+	return (bytes + wastebin_page_size - 1) & ~(wastebin_page_size - 1);
+}
+
+/*
+ * NUMA placement (-N). The waste region is divided into slices, one for each node
+ * that has memory and as large as that node. Each slice is bound to its node with
+ * mbind(), so pages locked in it come from that node rather than wherever first
+ * touch happens to put them. Without -N the region is one slice with no policy.
+ * Locking always proceeds from the start of a slice, so the taken part of every
+ * slice is a prefix of it.
+ */
+#define max_node_count 64
+struct waste_slice {
+	char *base;
+	size_t size;
+	size_t taken;
+	int node;		/* node the slice is bound to, -1 if unbound */
+};
+static struct waste_slice wastebin_slices[max_node_count];
+static unsigned wastebin_nslices = 0;
+static int wastebin_numa = 0;		/* -N option */
+
+/*
+ * desired state, sent as a message to the daemon if one is detected. Over the
+ * named pipe op is always WB_SET, over the control socket it may also be a query
+ * or a wait for the current target, and op and id are echoed in the reply
+ */
+enum wastebin_op { WB_SET, WB_QUERY, WB_WAIT, WB_HANDOVER, WB_EXIT };
+enum wastebin_setpoint { SETPOINT_NONE, SETPOINT_AVAIL, SETPOINT_PSI };
+enum wastebin_target { TARGET_ABSOLUTE, TARGET_PERCENT, TARGET_LEAVE, TARGET_RELATIVE };
+struct wastebin_request {
+	int op;
+	unsigned id;		/* set by control_call, echoed in the reply */
+	long membytes, cpus;
+	int per_node;		/* membytes is split as given by node_membytes */
+	long node_membytes[max_node_count];
+	char cpulist[1024];	/* cpus to take, instead of any cpus, if not empty */
+	int audit;		/* check residency of the whole region afterwards */
+	int burners;		/* cpus partly used by burner threads */
+	double burn_fraction;	/* fraction of each of those cpus used */
+	int setpoint;		/* steer membytes to hold a setpoint, if not SETPOINT_NONE */
+	double setpoint_value;	/* MemAvailable bytes, or memory pressure percent */
+	long cache_bytes;	/* last level cache to take, rounded to ways */
+	int cache_ways;		/* or the ways to take, if not 0 */
+	int bandwidth_pct;	/* memory bandwidth to take, percent */
+	int mem_target, cpus_target;	/* how membytes and cpus are meant, TARGET_* */
+	double mem_pct, cpus_pct;	/* the percentages of TARGET_PERCENT */
+	int huge;		/* WB_HANDOVER: the --huge mode of the taker */
+	long region_bytes;	/* and the size of its waste region */
+};
+
+/* reply on the control socket */
+enum wastebin_result { WB_APPLIED, WB_SUPERSEDED, WB_STATUS };
+static const char *result_names[] = { "reached", "superseded", "current" };
+struct wastebin_status {
+	int op;
+	unsigned id;
+	int result;
+	long target_membytes, target_cpus;	/* the request being applied */
+	long membytes, cpus;			/* achieved */
+	int burners;
+	double burn_fraction;
+	long max_membytes, max_cpus;		/* what could be wasted */
+	double elapsed;		/* seconds from receiving the request until replying */
+	int cache_ways, max_cache_ways;		/* taken, and in the cache */
+	int bandwidth_pct;			/* memory bandwidth taken */
+};
+
+/*
+ * Targets that depend on the host. <n>% and leave:<amount> are taken from what
+ * could be wasted, +<amount> and -<amount> from the target before. The client
+ * doesn't know the host's size, so these are sent as they are and the daemon
+ * resolves them when it takes the request, see resolve_request().
+ */
+/* parse such a target, returns 1 if arg is one, 0 if it isn't, -1 if invalid */
+static int parse_target(char *arg, int is_mem, long *value, int *how, double *pct)
+{
+	size_t len = strlen(arg);
+	char num[32], *endp;
+
+	if (len > 0 && arg[len - 1] == '%') {
+		*pct = strtod(arg, &endp);
+		*how = TARGET_PERCENT;
+		*value = 0;
+		return endp == arg || endp != arg + len - 1 || !(*pct >= 0 && *pct <= 100) ? -1 : 1;
+	}
+	if (strncmp(arg, "leave:", 6) == 0) {
+		snprintf(num, sizeof(num), "%s", arg + 6);
+		len = strlen(num);
+		if (!is_mem && len > 4 && strcmp(num + len - 4, "cpus") == 0)
+			num[len - 4] = '\0';
+		*how = TARGET_LEAVE;
+	} else if (arg[0] == '+' || arg[0] == '-') {
+		snprintf(num, sizeof(num), "%s", arg + 1);
+		*how = TARGET_RELATIVE;
+	} else {
+		return 0;
+	}
+	*value = is_mem ? strm2ul(num) : str2ul(num);
+	if (*value < 0)
+		return -1;
+	if (arg[0] == '-')
+		*value = -*value;
+	return 1;
+}
+
+/*
+ * <mem> is either a size, <size>@all to balance it across nodes, or a comma separated
+ * list of <size>@<node>. returns 0 on success, -1 on bad syntax
+ */
+static int parse_memarg(char *arg, struct wastebin_request *req)
+{
+	char *copy, *item, *save, *at;
+	long bytes, node;
+	int ec = 0;
+
+	if (strncmp(arg, "avail:", 6) == 0) {
+		req->setpoint = SETPOINT_AVAIL;
+		req->setpoint_value = strm2ul(arg + 6);
+		return req->setpoint_value < 0 ? -1 : 0;
+	}
+	if (strncmp(arg, "psi:", 4) == 0) {
+		req->setpoint = SETPOINT_PSI;
+		req->setpoint_value = strtod(arg + 4, &at);
+		return *at != '\0' || !(req->setpoint_value > 0 && req->setpoint_value < 100) ?
+			-1 : 0;
+	}
+	ec = parse_target(arg, 1, &req->membytes, &req->mem_target, &req->mem_pct);
+	if (ec != 0)
+		return ec < 0 ? -1 : 0;
+	if (strchr(arg, '@') == NULL) {
+		req->membytes = strm2ul(arg);
+		return req->membytes < 0 ? -1 : 0;
+	}
+	copy = strdup(arg);
+	if (copy == NULL)
+		return -1;
+	req->membytes = 0;
+	for (item = strtok_r(copy, ",", &save); item != NULL && ec == 0;
+	     item = strtok_r(NULL, ",", &save)) {
+		at = strchr(item, '@');
+		if (at == NULL) {
+			ec = -1;
+			break;
+		}
+		*at++ = '\0';
+		bytes = strm2ul(item);
+		if (bytes < 0) {
+			ec = -1;
+		} else if (strcmp(at, "all") == 0) {
+			/* balanced across nodes, can't be mixed with per node sizes */
+			if (req->per_node || req->membytes != 0 || strchr(arg, ',') != NULL)
+				ec = -1;
+			req->membytes = bytes;
+			wastebin_numa = 1;
+		} else {
+			node = str2ul(at);
+			if (node < 0 || node >= max_node_count)
+				ec = -1;
+			else {
+				req->per_node = 1;
+				req->node_membytes[node] += bytes;
+				req->membytes += bytes;
+				wastebin_numa = 1;
+			}
+		}
+	}
+	free(copy);
+	return ec;
+}
+
+/*
+ * Sets of cpus (and of nodes) are bitmaps. Cpu sets hold nr_cpu_ids bits, one more
+ * than the highest cpu in /sys/devices/system/cpu/possible, and are allocated at
+ * startup, so no cpu of a large machine is out of reach. Sets are counted with
+ * popcount and walked a word at a time, so the cost follows the number of ids in
+ * the set rather than the size of the machine.
+ */
+#define set_word_bits (8 * sizeof(unsigned long))
+#define set_words(max) (((max) + set_word_bits - 1) / set_word_bits)
+static unsigned nr_cpu_ids = 0;
+static unsigned long *cpus_online;
+static unsigned long *cpus_taken;
+static unsigned wastebin_cpus_taken = 0;
+static unsigned *cpus_taken_order;	/* cpus in the order they were taken */
+
+static int id_in_set(unsigned long *set, unsigned id)
+{
+	return (set[id / set_word_bits] >> (id % set_word_bits)) & 1;
+}
+
+static void add_id(unsigned long *set, unsigned id)
+{
+	set[id / set_word_bits] |= 1UL << (id % set_word_bits);
+}
+
+static void del_id(unsigned long *set, unsigned id)
+{
+	set[id / set_word_bits] &= ~(1UL << (id % set_word_bits));
+}
+
+static unsigned count_ids(unsigned long *set, unsigned max)
+{
+	unsigned count = 0;
+	for (size_t w = 0; w < set_words(max); w++)
+		count += __builtin_popcountl(set[w]);
+	return count;
+}
+
+/* the first id >= from in the set, or not in it if absent is set. max if none */
+static unsigned next_id(unsigned long *set, unsigned max, unsigned from, int absent)
+{
+	size_t w = from / set_word_bits;
+	unsigned long word;
+
+	if (from >= max)
+		return max;
+	word = (absent ? ~set[w] : set[w]) & (~0UL << (from % set_word_bits));
+	while (word == 0) {
+		if (++w >= set_words(max))
+			return max;
+		word = absent ? ~set[w] : set[w];
+	}
+	from = w * set_word_bits + __builtin_ctzl(word);
+	return from < max ? from : max;
+}
+
+#define for_each_id(id, set, max) \
+	for ((id) = next_id(set, max, 0, 0); (id) < (max); (id) = next_id(set, max, (id) + 1, 0))
+
+static void *calloc_or_exit(size_t n, size_t size)
+{
+	void *p = calloc(n, size);
+	if (p == NULL) {
+		perror("allocating cpu sets");
+		fflush(stderr);
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static unsigned long *alloc_cpu_set(void)
+{
+	return calloc_or_exit(set_words(nr_cpu_ids), sizeof(unsigned long));
+}
+
+/* pin threads created with attr to cpu, with a cpu_set_t sized for every cpu */
+static void pin_thread_attr(pthread_attr_t *attr, unsigned cpu)
+{
+	size_t size = CPU_ALLOC_SIZE(nr_cpu_ids);
+	cpu_set_t *set = CPU_ALLOC(nr_cpu_ids);
+
+	if (set == NULL)
+		return;
+	CPU_ZERO_S(size, set);
+	CPU_SET_S(cpu, size, set);
+	pthread_attr_setaffinity_np(attr, size, set);
+	CPU_FREE(set);
+}
+
+/*
+ * Id lists. Cpu and node lists such as 0-3,8-11 are parsed in a single pass
+ * over their characters, which may arrive in pieces, so a sysfs file of any
+ * length is read through a small buffer and nothing is allocated. Ids at or
+ * above max are counted in highest but left out of the set, which may be NULL.
+ */
+struct id_parser {
+	unsigned long first, cur;	/* start of a range, id being read */
+	int digits, range, error;
+	int comma;			/* a comma with no id after it yet */
+	long highest;			/* highest id seen, -1 if none */
+};
+#define ID_PARSER_INIT { 0, 0, 0, 0, 0, 0, -1 }
+
+static void id_list_commit(struct id_parser *p, unsigned long *set, unsigned max)
+{
+	unsigned long lo = p->range ? p->first : p->cur, hi = p->cur;
+
+	if (lo > hi)
+		p->error = 1;
+	else if ((long)hi > p->highest)
+		p->highest = hi;
+	for (unsigned long id = lo; set != NULL && id <= hi && id < max; id++)
+		add_id(set, id);
+	p->cur = p->digits = p->range = 0;
+}
+
+static void id_list_feed(struct id_parser *p, const char *buf, size_t nb,
+			 unsigned long *set, unsigned max)
+{
+	for (size_t i = 0; i < nb && !p->error; i++) {
+		char c = buf[i];
+		if (c >= '0' && c <= '9') {
+			p->cur = p->cur * 10 + (c - '0');
+			if (p->cur > UINT_MAX)
+				p->error = 1;
+			p->digits++;
+			p->comma = 0;
+		} else if (c == '-' && p->digits && !p->range) {
+			p->first = p->cur;
+			p->cur = p->digits = 0;
+			p->range = 1;
+		} else if (c == ',' && p->digits) {
+			id_list_commit(p, set, max);
+			p->comma = 1;
+		} else if ((c == '\n' || c == ' ' || c == '\0') && (p->digits || !p->range) &&
+			   !p->comma) {
+			if (p->digits)
+				id_list_commit(p, set, max);
+		} else {
+			p->error = 1;
+		}
+	}
+}
+
+/* finish a list, returns 0 or -1 if its syntax was invalid */
+static int id_list_end(struct id_parser *p, unsigned long *set, unsigned max)
+{
+	if (p->digits)
+		id_list_commit(p, set, max);
+	else if (p->range || p->comma)
+		p->error = 1;
+	return p->error ? -1 : 0;
+}
+
+/*
+ * parse a list of ids such as 0-3,8 from the nb chars in buf into the set,
+ * ignoring ids >= max. returns 0, or -1 if the syntax is invalid
+ */
+static int parse_id_list(char *buf, size_t nb, unsigned long *set, unsigned max)
+{
+	struct id_parser p = ID_PARSER_INIT;
+
+	id_list_feed(&p, buf, nb, set, max);
+	if (id_list_end(&p, set, max) == 0)
+		return 0;
+	fprintf(stderr, "invalid id list '%.*s'\n", (int)nb, buf);
+	return -1;
+}
+
+/*
+ * parse a sysfs list of ids such as 0-3,8 into the set, ignoring ids >= max.
+ * returns the highest id in the file, or -1 if it can't be read or parsed
+ */
+static long parse_sysfs_set(char *sysfile, unsigned long *set, unsigned max)
+{
+	struct id_parser p = ID_PARSER_INIT;
+	char buf[4096];
+	ssize_t nb;
+	int fh;
+
+	fh = open(sysfile, O_RDONLY);
+	if (fh < 0)
+		return -1;
+	while ((nb = read(fh, buf, sizeof(buf))) > 0)
+		id_list_feed(&p, buf, nb, set, max);
+	close(fh);
+	return nb < 0 || id_list_end(&p, set, max) < 0 ? -1 : p.highest;
+}
+
+/* returns 0, or -1 if a per node target names a node that has no memory */
+static int check_mem_nodes(struct wastebin_request *req)
+{
+	unsigned long nodes[set_words(max_node_count)] = { 0 };
+
+	if (!req->per_node)
+		return 0;
+	if (parse_sysfs_set("/sys/devices/system/node/has_memory", nodes, max_node_count) < 0)
+		add_id(nodes, 0);	/* no NUMA, all memory is node 0 */
+	for (unsigned node = 0; node < max_node_count; node++)
+		if (req->node_membytes[node] > 0 && !id_in_set(nodes, node))
+			return -1;
+	return 0;
+}
+
+/*
+ * CPU selection policy (-c). Which cpus are taken decides what the downsized
+ * machine looks like to the scheduler. Taking one hyperthread of a core hands its
+ * sibling the whole core's caches, and emptying sockets unevenly skews memory
+ * locality. "highest" takes the highest numbered cpu first, "cores" takes whole
+ * cores, "smt" takes the second threads of all cores before any first thread,
+ * "spread" takes whole cores evenly across sockets and "socket" empties the
+ * highest numbered socket before the next. Cpus are given back in the reverse
+ * of the order they were taken. Topology is read at inventory, while every cpu
+ * is online and so has a topology directory.
+ */
+enum cpu_policy { POLICY_HIGHEST, POLICY_CORES, POLICY_SMT, POLICY_SPREAD, POLICY_SOCKET };
+static const char *cpu_policy_names[] = { "highest", "cores", "smt", "spread", "socket" };
+static enum cpu_policy wastebin_cpu_policy = POLICY_HIGHEST;
+static unsigned *cpu_package;
+static unsigned *cpu_core;	/* lowest numbered thread of the core */
+static unsigned *cpu_thread;	/* index of the cpu among its core's threads */
+static unsigned long *cpus_fixed;	/* online cpus that can't go offline */
+
+/* size the cpu sets and per cpu tables for the cpus this machine could have */
+static void size_cpu_sets(void)
+{
+	long highest = parse_sysfs_set("/sys/devices/system/cpu/possible", NULL, 0);
+
+	if (highest < 0)
+		highest = sysconf(_SC_NPROCESSORS_CONF) - 1;
+	nr_cpu_ids = highest < 0 ? 1 : highest + 1;
+	cpus_online = alloc_cpu_set();
+	cpus_taken = alloc_cpu_set();
+	cpus_fixed = alloc_cpu_set();
+	cpus_taken_order = calloc_or_exit(nr_cpu_ids, sizeof(unsigned));
+	cpu_package = calloc_or_exit(nr_cpu_ids, sizeof(unsigned));
+	cpu_core = calloc_or_exit(nr_cpu_ids, sizeof(unsigned));
+	cpu_thread = calloc_or_exit(nr_cpu_ids, sizeof(unsigned));
+}
+
+static int parse_cpu_policy(char *arg)
+{
+	for (unsigned i = 0; i < sizeof(cpu_policy_names) / sizeof(cpu_policy_names[0]); i++)
+		if (strcmp(arg, cpu_policy_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+static void set_cpu_online_state(unsigned cpu, char online_state)
+{
+	char sysfile[64];
+	size_t nb;
+	int fh;
+	char digit;
+
+	nb = snprintf(sysfile, sizeof(sysfile) - 1, "/sys/devices/system/cpu/cpu%u/online", cpu);
+	sysfile[nb] = '\0';
+	fh = open(sysfile, O_WRONLY);
+	if (fh < 0) {
+		perror("opening cpu online state file");
+		fflush(stderr);
+		exit(EXIT_FAILURE);
+	}
+	digit = "01"[(int)online_state];
+	nb = write(fh, &digit, sizeof(digit));
+	if (nb < sizeof(digit)) {
+		perror("writing online state");
+		fflush(stderr);
+		exit(EXIT_FAILURE);
+	}
+	close(fh);
+}
+
+static void parse_sysfs_cpu_set(char *syscpuset, unsigned long *cpu_set)
+{
+	char sysfile[64];
+	size_t nb;
+	nb = snprintf(sysfile, sizeof(sysfile) - 1, "/sys/devices/system/cpu/%s", syscpuset);
+	sysfile[nb] = '\0';
+	parse_sysfs_set(sysfile, cpu_set, nr_cpu_ids);
+}
+
+static unsigned count_cpu_set(unsigned long *cpu_set)
+{
+	return count_ids(cpu_set, nr_cpu_ids);
+}
+
+/*
+ * format the ids in the set as a list such as 0-3,8 into buf, as much as fits
+ * in len. returns the length of the whole list, like snprintf
+ */
+static size_t format_id_list(unsigned long *set, unsigned max, char *buf, size_t len)
+{
+	size_t at = 0;
+	unsigned first, last;
+
+	if (len > 0)
+		buf[0] = '\0';
+	for (first = next_id(set, max, 0, 0); first < max;
+	     first = next_id(set, max, last + 1, 0)) {
+		last = next_id(set, max, first, 1) - 1;
+		at += snprintf(buf + (at < len ? at : len), at < len ? len - at : 0,
+			       first == last ? "%s%u" : "%s%u-%u", at ? "," : "", first, last);
+	}
+	return at;
+}
+
+/* the list of ids in the set, allocated to fit */
+static char *id_list_string(unsigned long *set, unsigned max)
+{
+	size_t len = format_id_list(set, max, NULL, 0) + 1;
+	char *buf = calloc_or_exit(len, 1);
+
+	format_id_list(set, max, buf, len);
+	return buf;
+}
+
+static void show_cpu_set(char *syscpuset, unsigned long *cpu_set)
+{
+	char *list = id_list_string(cpu_set, nr_cpu_ids);
+	printf("CPUs %s: %s\n", syscpuset, list[0] ? list : "none");
+	free(list);
+}
+
+/* count the resident pages in a range of the waste region */
+static size_t count_incore(char *startp, size_t len)
+{
+	unsigned char ic_vec[4096];
+	size_t step = sizeof(ic_vec) << 12;
+	int ec;
+	char *scanp;
+	char *endp = startp + len;
+	size_t pages = 0;
+	for (scanp = startp; scanp < endp; scanp += step) { 
+		if (scanp + step > endp) /* partial last step */
+			step = endp - scanp;
+		ec = mincore(scanp, step, ic_vec);
+		if (ec < 0)
+			fprintf(stderr, "mincore failed @%lx, taken was %lx\n",
+				scanp - wastebin_memory, wastebin_memory_taken);
+		else {
+			int npgs = step >> 12;
+			for (int i = 0; i < npgs; i++)
+				if (ic_vec[i] & 1) pages += 1;
+		}
+	}
+	return pages;
+}
+
+/* VmLck of this process in bytes, or -1 if it can't be read */
+static long locked_vm_bytes(void)
+{
+	char line[128];
+	FILE *fh;
+	long kb = -1;
+
+	fh = fopen("/proc/self/status", "r");
+	if (fh == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fh) != NULL)
+		if (sscanf(line, "VmLck: %ld kB", &kb) == 1)
+			break;
+	fclose(fh);
+	return kb < 0 ? -1 : kb << 10;
+}
+
+/*
+ * Report what is wasted from the bookkeeping in wastebin_slices, which is kept up
+ * to date as each range is locked or released, so the cost does not grow with the
+ * size of the machine. The kernel's count of locked memory is a cheap cross check
+ * (hugetlb mappings are not counted in it). A mincore() audit of the whole region,
+ * which walks the page tables for all of physical memory, is only done when a
+ * request asks for it with -a.
+ */
+static void show_incore_memory(char *cmdstr)
+{
+	long locked;
+	for (unsigned i = 0; i < wastebin_nslices; i++) {
+		struct waste_slice *slice = &wastebin_slices[i];
+		if (slice->node >= 0)
+			printf("%s: node %d wasting %'lu bytes out of %'lu\n", cmdstr,
+			       slice->node, slice->taken, slice->size);
+	}
+	printf("%s: now wasting %'lu bytes out of %'lu\n", cmdstr, wastebin_memory_taken,
+	       wastebin_max_size);
+	if (!(wastebin_map_flags & MAP_HUGETLB)) {
+		locked = locked_vm_bytes();
+		if (locked >= 0 && locked != wastebin_memory_taken)
+			printf("%s: but the kernel reports %'ld bytes locked\n", cmdstr, locked);
+	}
+	fflush(stdout);
+}
+
+/* check that a range just locked is all resident, or one just released is not */
+static void verify_range(char *startp, size_t len, int resident, char *cmdstr)
+{
+	size_t pages = count_incore(startp, len);
+	size_t expected = resident ? len >> 12 : 0;
+	if (pages != expected)
+		fprintf(stderr, "%s: %'lu bytes resident in a range expected to have %'lu\n",
+			cmdstr, pages << 12, expected << 12);
+}
+
+static void audit_incore_memory(char *cmdstr)
+{
+	size_t pages = 0, node_pages;
+	for (unsigned i = 0; i < wastebin_nslices; i++) {
+		struct waste_slice *slice = &wastebin_slices[i];
+		node_pages = count_incore(slice->base, slice->size);
+		if (node_pages << 12 != slice->taken)
+			fprintf(stderr, "%s: audit found %'lu bytes resident in a slice with %'lu taken\n",
+				cmdstr, node_pages << 12, slice->taken);
+		pages += node_pages;
+	}
+	printf("%s: audit found %'lu bytes resident out of %'lu\n", cmdstr, pages << 12,
+	       wastebin_max_size);
+	fflush(stdout);
+}
+
+static double elapsed_since(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/*
+ * Event log (-E). The text log is for people; for analysis the daemon can also
+ * write its transitions as fixed size binary records to a file. Each record
+ * holds the monotonic time, what happened, the request being applied, its
+ * targets and what is taken, and how long the step took. Records collect in a
+ * ring in memory and are written out in batches, when the ring is full and
+ * whenever the daemon goes idle, so logging costs no system call per event.
+ * The file starts with a header relating the monotonic clock to the wall
+ * clock, and is rotated to <file>.1 when it grows past --events-size.
+ * 'wastebin decode' prints event files as CSV or as JSON lines.
+ */
+#define EVENT_MAGIC 0x76656277	/* "wbev" */
+#define EVENT_VERSION 1
+enum event_type {
+	EV_START, EV_REQUEST, EV_OFFLINE, EV_ONLINE, EV_CPUSET, EV_LOCK, EV_RELEASE,
+	EV_BLOCKS, EV_REACHED, EV_SUPERSEDED, EV_EXIT, EV_LIMIT, EV_NTYPES
+};
+static const char *event_names[] = {
+	"start", "request", "offline", "online", "cpuset", "lock", "release",
+	"blocks", "reached", "superseded", "exit", "limit"
+};
+struct wastebin_event_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	int32_t pid;
+	int64_t mono_ns;	/* CLOCK_MONOTONIC and CLOCK_REALTIME at the same time */
+	int64_t real_ns;
+	char reserved[32];
+};
+struct wastebin_event {
+	int64_t ns;		/* CLOCK_MONOTONIC */
+	uint32_t type;
+	uint32_t gen;		/* request number */
+	int64_t target_membytes;
+	int64_t membytes;	/* taken, locked and in offline blocks */
+	int32_t target_cpus;
+	int32_t cpus;
+	int64_t duration_ns;
+	int64_t value;		/* the cpu, or bytes locked, released or offline */
+	char reserved[8];
+};
+#define event_ring_size 1024
+static char *events_path = NULL;	/* -E option */
+static long events_max = 64L << 20;	/* -Z option */
+static int events_fd = -1;
+static long events_written;
+static struct wastebin_event event_ring[event_ring_size];
+static unsigned event_count;
+/* the request being applied, as the main loop last set it */
+static uint32_t event_gen;
+static int64_t event_target_membytes;
+static int32_t event_target_cpus;
+
+static int64_t clock_ns(clockid_t clock)
+{
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/* start the event log with its header, returns -1 with events_fd -1 if it can't */
+static int open_events(void)
+{
+	struct wastebin_event_header h = { 0 };
+
+	if (events_path == NULL)
+		return 0;
+	events_fd = open(events_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (events_fd < 0)
+		return -1;
+	h.magic = EVENT_MAGIC;
+	h.version = EVENT_VERSION;
+	h.record_size = sizeof(struct wastebin_event);
+	h.pid = getpid();
+	h.mono_ns = clock_ns(CLOCK_MONOTONIC);
+	h.real_ns = clock_ns(CLOCK_REALTIME);
+	if (write(events_fd, &h, sizeof(h)) != sizeof(h)) {
+		close(events_fd);
+		events_fd = -1;
+		return -1;
+	}
+	events_written = sizeof(h);
+	return 0;
+}
+
+/* write out the ring, rotating the file first if it has grown too large */
+static void flush_events(char *cmdstr)
+{
+	char old[PATH_MAX];
+	ssize_t len = event_count * sizeof(struct wastebin_event);
+
+	if (events_fd < 0 || event_count == 0)
+		return;
+	if (events_max > 0 && events_written + len > events_max) {
+		snprintf(old, sizeof(old), "%s.1", events_path);
+		close(events_fd);
+		if (rename(events_path, old) < 0)
+			fprintf(stderr, "%s: can't rotate event log to %s\n", cmdstr, old);
+		if (open_events() < 0) {
+			fprintf(stderr, "%s: can't reopen event log %s, no more events are logged\n",
+				cmdstr, events_path);
+			event_count = 0;
+			return;
+		}
+	}
+	if (write(events_fd, event_ring, len) != len) {
+		fprintf(stderr, "%s: can't write event log, no more events are logged\n", cmdstr);
+		close(events_fd);
+		events_fd = -1;
+	}
+	events_written += len;
+	event_count = 0;
+}
+
+/* set the request that following events belong to */
+static void event_request(uint32_t gen, long membytes, long cpus)
+{
+	event_gen = gen;
+	event_target_membytes = membytes;
+	event_target_cpus = cpus;
+}
+
+static void log_event(enum event_type type, int64_t value, double secs, char *cmdstr)
+{
+	struct wastebin_event *ev;
+
+	if (events_fd < 0)
+		return;
+	ev = &event_ring[event_count++];
+	memset(ev, 0, sizeof(*ev));
+	ev->ns = clock_ns(CLOCK_MONOTONIC);
+	ev->type = type;
+	ev->gen = event_gen;
+	ev->target_membytes = event_target_membytes;
+	ev->membytes = memory_wasted();
+	ev->target_cpus = event_target_cpus;
+	ev->cpus = wastebin_cpus_taken;
+	ev->duration_ns = secs * 1e9;
+	ev->value = value;
+	if (event_count == event_ring_size)
+		flush_events(cmdstr);
+}
+
+/*
+ * cpuset backend (-b cpuset). Rather than taking cpus offline, which costs tens
+ * of milliseconds per cpu and disturbs interrupts and per-cpu kernel threads,
+ * taken cpus are kept from other tasks with cgroup v2 cpusets, which takes a
+ * few milliseconds for any number of cpus. By default the taken cpus are moved
+ * into an isolated partition, /sys/fs/cgroup/wastebin, so the root partition and
+ * every task in it lose them. With -b cpuset:<cgroup>, that cgroup's
+ * cpuset.cpus is limited to the cpus not taken, and restored once none are.
+ * Hotplug remains the most realistic backend.
+ */
+enum cpu_backend { CPU_HOTPLUG, CPU_CPUSET };
+static enum cpu_backend wastebin_cpu_backend = CPU_HOTPLUG;
+static char *cpuset_target = NULL;	/* cgroup to limit, NULL for the root partition */
+static char cpuset_saved[8192];		/* its cpuset.cpus before any cpus were taken */
+#define cpuset_partition "/sys/fs/cgroup/wastebin"
+
+static int parse_cpu_backend(char *arg)
+{
+	if (strcmp(arg, "hotplug") == 0) {
+		wastebin_cpu_backend = CPU_HOTPLUG;
+	} else if (strncmp(arg, "cpuset", 6) == 0 && (arg[6] == '\0' || arg[6] == ':')) {
+		wastebin_cpu_backend = CPU_CPUSET;
+		cpuset_target = arg[6] == ':' ? arg + 7 : NULL;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static void cpuset_write(char *dir, char *file, char *value, char *cmdstr)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if (write_file(path, value) < 0) {
+		fprintf(stderr, "%s: writing '%s' to %s: %s\n", cmdstr, value, path,
+			strerror(errno));
+		fail_exit("setting cpuset", cmdstr);
+	}
+}
+
+static void inventory_cpuset(char *cmdstr)
+{
+	char path[PATH_MAX];
+	if (wastebin_cpu_backend != CPU_CPUSET)
+		return;
+	if (cpuset_target != NULL) {
+		snprintf(path, sizeof(path), "%s/cpuset.cpus", cpuset_target);
+		if (read_file(path, cpuset_saved, sizeof(cpuset_saved)) < 0)
+			fail_exit("reading cpuset.cpus of target cgroup", cmdstr);
+		printf("%s: limiting cpus of %s, now '%s'\n", cmdstr, cpuset_target, cpuset_saved);
+	} else {
+		printf("%s: moving taken cpus to partition %s\n", cmdstr, cpuset_partition);
+	}
+}
+
+static void apply_cpuset(char *cmdstr)
+{
+	char list[64], *cpus = NULL;
+	unsigned long *states = alloc_cpu_set();
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (cpuset_target != NULL) {
+		/* the cpus the cgroup had, or all online if it inherited them, less taken */
+		if (cpuset_saved[0] == '\0')
+			memcpy(states, cpus_online, set_words(nr_cpu_ids) * sizeof(*states));
+		else
+			parse_id_list(cpuset_saved, strlen(cpuset_saved), states, nr_cpu_ids);
+		for (size_t w = 0; w < set_words(nr_cpu_ids); w++)
+			states[w] &= ~cpus_taken[w];
+		cpus = id_list_string(states, nr_cpu_ids);
+		cpuset_write(cpuset_target, "cpuset.cpus", wastebin_cpus_taken == 0 ? cpuset_saved :
+			     cpus, cmdstr);
+	} else if (wastebin_cpus_taken > 0) {
+		cpuset_write("/sys/fs/cgroup", "cgroup.subtree_control", "+cpuset", cmdstr);
+		if (mkdir(cpuset_partition, S_IRWXU) < 0 && errno != EEXIST)
+			fail_exit("creating cpuset partition", cmdstr);
+		cpus = id_list_string(cpus_taken, nr_cpu_ids);
+		cpuset_write(cpuset_partition, "cpuset.cpus", cpus, cmdstr);
+		cpuset_write(cpuset_partition, "cpuset.cpus.partition", "isolated", cmdstr);
+		if (read_file(cpuset_partition "/cpuset.cpus.partition", list, sizeof(list)) == 0 &&
+		    strcmp(list, "isolated") != 0)
+			fprintf(stderr, "%s: cpuset partition is '%s'\n", cmdstr, list);
+	} else if (access(cpuset_partition, F_OK) == 0) {
+		cpuset_write(cpuset_partition, "cpuset.cpus.partition", "member", cmdstr);
+		if (rmdir(cpuset_partition) < 0)
+			fprintf(stderr, "%s: can't remove %s\n", cmdstr, cpuset_partition);
+	}
+	log_event(EV_CPUSET, wastebin_cpus_taken, elapsed_since(&start), cmdstr);
+	printf("%s: cpuset updated in %.3f ms\n", cmdstr, elapsed_since(&start) * 1e3);
+	fflush(stdout);
+	free(cpus);
+	free(states);
+}
+
+static void inventory_topology(char *cmdstr)
+{
+	char sysfile[64];
+	long *core = calloc_or_exit(nr_cpu_ids, sizeof(long));
+	unsigned cpu, sib;
+
+	for_each_id(cpu, cpus_online, nr_cpu_ids) {
+		cpu_package[cpu] = read_sysfs_long(
+			"/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+		core[cpu] = read_sysfs_long("/sys/devices/system/cpu/cpu%u/topology/core_id", cpu);
+		if (cpu_package[cpu] >= nr_cpu_ids)	/* unknown, or too large to count by */
+			cpu_package[cpu] = 0;
+		/* the core is named by its first thread, and threads numbered in order */
+		cpu_core[cpu] = cpu;
+		cpu_thread[cpu] = 0;
+		if (core[cpu] >= 0)
+			for_each_id(sib, cpus_online, cpu)
+				if (cpu_package[sib] == cpu_package[cpu] && core[sib] == core[cpu]) {
+					cpu_core[cpu] = cpu_core[sib];
+					cpu_thread[cpu] = cpu_thread[sib] + 1;
+				}
+		snprintf(sysfile, sizeof(sysfile), "/sys/devices/system/cpu/cpu%u/online", cpu);
+		if (access(sysfile, W_OK) != 0)
+			add_id(cpus_fixed, cpu);
+	}
+	free(core);
+	printf("%s: taking cpus by %s policy\n", cmdstr, cpu_policy_names[wastebin_cpu_policy]);
+}
+
+static void inventory_cpus(char *cmdstr)
+{
+	parse_sysfs_cpu_set("online", cpus_online);
+	show_cpu_set("online", cpus_online);
+	inventory_topology(cmdstr);
+	inventory_cpuset(cmdstr);
+}
+
+/* free pages in the hugetlb pool of wastebin_page_size, or -1 if unknown */
+static long free_hugepages(void)
+{
+	return read_sysfs_long("/sys/kernel/mm/hugepages/hugepages-%lukB/free_hugepages",
+			       wastebin_page_size >> 10);
+}
+
+static void bind_range(char *start, size_t len, int node, char *cmdstr)
+{
+	unsigned long nodemask[max_node_count / (8 * sizeof(long))] = { 0 };
+	if (node < 0)
+		return;
+	nodemask[node / (8 * sizeof(long))] = 1UL << (node % (8 * sizeof(long)));
+	if (syscall(SYS_mbind, start, len, MPOL_BIND, nodemask, max_node_count + 1, 0) < 0)
+		fprintf(stderr, "%s: could not bind memory to node %d, %s\n", cmdstr, node,
+			strerror(errno));
+}
+
+/* size of a node's memory from its meminfo, 0 if unknown */
+static size_t node_memory_size(int node)
+{
+	char sysfile[64];
+	char line[128];
+	FILE *fh;
+	unsigned long kb = 0;
+
+	snprintf(sysfile, sizeof(sysfile), "/sys/devices/system/node/node%d/meminfo", node);
+	fh = fopen(sysfile, "r");
+	if (fh == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fh) != NULL)
+		if (sscanf(line, "Node %*d MemTotal: %lu kB", &kb) == 1)
+			break;
+	fclose(fh);
+	return kb << 10;
+}
+
+/* carve the waste region into slices, per node with memory if -N was given */
+static void inventory_nodes(char *cmdstr)
+{
+	unsigned long nodes[set_words(max_node_count)] = { 0 };
+	size_t offset = 0, size;
+	unsigned node;
+
+	wastebin_nslices = 0;
+	if (wastebin_numa)
+		parse_sysfs_set("/sys/devices/system/node/has_memory", nodes, max_node_count);
+	for_each_id(node, nodes, max_node_count) {
+		size = node_memory_size(node) & ~(wastebin_page_size - 1);
+		if (size > wastebin_max_size - offset)
+			size = wastebin_max_size - offset;
+		if (size == 0)
+			continue;
+		wastebin_slices[wastebin_nslices++] = (struct waste_slice){
+			wastebin_memory + offset, size, 0, node };
+		bind_range(wastebin_memory + offset, size, node, cmdstr);
+		offset += size;
+	}
+	if (wastebin_nslices == 0) {
+		if (wastebin_numa)
+			fprintf(stderr, "%s: no NUMA nodes found, not binding memory\n", cmdstr);
+		wastebin_slices[wastebin_nslices++] = (struct waste_slice){
+			wastebin_memory, wastebin_max_size, 0, -1 };
+	} else {
+		wastebin_max_size = offset;
+	}
+}
+
+/* map the memfd, creating it unless one was handed over */
+static char *map_memfd(char *cmdstr)
+{
+	unsigned flags = MFD_CLOEXEC;
+	struct stat sb;
+	char *area, *aligned;
+
+	if (wastebin_huge == HUGE_2M)
+		flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+	else if (wastebin_huge == HUGE_1G)
+		flags |= MFD_HUGETLB | MFD_HUGE_1GB;
+	if (wastebin_memfd < 0) {
+		wastebin_memfd = memfd_create("wastebin", flags);
+		if (wastebin_memfd < 0)
+			fail_exit("creating memfd", cmdstr);
+		if (ftruncate(wastebin_memfd, wastebin_max_size) < 0)
+			fail_exit("sizing memfd", cmdstr);
+	} else if (fstat(wastebin_memfd, &sb) < 0 || sb.st_size != wastebin_max_size) {
+		fail_exit("memfd handed over does not match the size of the region", cmdstr);
+	}
+	/* reserve room to align the mapping to the page size, as THP needs */
+	area = mmap(NULL, wastebin_max_size + wastebin_page_size, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (area == MAP_FAILED)
+		fail_exit("getting waste memory segment", cmdstr);
+	aligned = (char *)round_to_page((size_t)area);
+	if (mmap(aligned, wastebin_max_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED | MAP_NORESERVE, wastebin_memfd, 0) == MAP_FAILED)
+		fail_exit("mapping memfd", cmdstr);
+	if (aligned != area)
+		munmap(area, aligned - area);
+	munmap(aligned + wastebin_max_size, wastebin_page_size - (aligned - area));
+	wastebin_map_flags = (wastebin_map_flags & ~MAP_PRIVATE) | MAP_SHARED;
+	memfd_fallocate = !((flags & MFD_HUGETLB) && wastebin_numa);
+	printf("%s: waste region is a memfd of %'ld bytes\n", cmdstr, wastebin_max_size);
+	return aligned;
+}
+
+/* the size of the waste region, all of physical memory in whole pages of the mode */
+static long region_size(enum huge_mode huge)
+{
+	long pages = sysconf(_SC_PHYS_PAGES);
+	size_t page = huge == HUGE_1G ? 1UL << 30 : huge == HUGE_NONE ? 1UL << 12 : 2UL << 20;
+
+	if (pages < 0)
+		return -1;
+	return (pages << 12) & ~(page - 1);
+}
+
+static void inventory_memory(char *cmdstr)
+{
+	wastebin_max_size = region_size(wastebin_huge);
+	if (wastebin_max_size < 0)
+		fail_exit("getting physical memory size", cmdstr);
+	switch (wastebin_huge) {
+	case HUGE_NONE:
+		break;
+	case HUGE_THP:
+		wastebin_page_size = 2UL << 20;
+		break;
+	case HUGE_2M:
+		wastebin_page_size = 2UL << 20;
+		wastebin_map_flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+		break;
+	case HUGE_1G:
+		wastebin_page_size = 1UL << 30;
+		wastebin_map_flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+		break;
+	}
+	if (wastebin_release == RELEASE_REMOVE)
+		wastebin_map_flags = (wastebin_map_flags & ~MAP_PRIVATE) | MAP_SHARED;
+	/* create anonymous private memory segment to waste memory. hugetlb
+	 * mappings come back aligned, THP needs room to align by hand */
+	if (wastebin_use_memfd)
+		wastebin_memory = map_memfd(cmdstr);
+	else
+		wastebin_memory = mmap(NULL, wastebin_max_size + (wastebin_huge == HUGE_THP ?
+								  wastebin_page_size : 0),
+				       PROT_READ | PROT_WRITE, wastebin_map_flags, -1, 0);
+	if (wastebin_memory == MAP_FAILED) {
+		fail_exit("getting waste memory segment", cmdstr);
+	}
+	if (wastebin_huge == HUGE_THP && !wastebin_use_memfd) {
+		char *aligned = (char *)round_to_page((size_t)wastebin_memory);
+		if (aligned != wastebin_memory)
+			munmap(wastebin_memory, aligned - wastebin_memory);
+		munmap(aligned + wastebin_max_size,
+		       wastebin_page_size - (aligned - wastebin_memory));
+		wastebin_memory = aligned;
+	}
+	wastebin_memory_taken = 0;
+	/* unless asked for huge pages, disable them in this region so MADV_REMOVE
+	 * will actually succeed. Also disable samepage merging so pages are not merged */
+	if (wastebin_huge == HUGE_THP)
+		madvise(wastebin_memory, wastebin_max_size, MADV_HUGEPAGE);
+	else if (wastebin_huge == HUGE_NONE)
+		madvise(wastebin_memory, wastebin_max_size, MADV_NOHUGEPAGE);
+	madvise(wastebin_memory, wastebin_max_size, MADV_UNMERGEABLE);
+	if (wastebin_huge == HUGE_2M || wastebin_huge == HUGE_1G)
+		printf("%s: using %luK hugetlb pages, %ld free in the pool\n", cmdstr,
+		       wastebin_page_size >> 10, free_hugepages());
+	inventory_nodes(cmdstr);
+
+	show_incore_memory(cmdstr);
+}
+
+/*
+ * Hotplug batches. Taking a cpu offline or online is slow in the kernel, so the
+ * transitions chosen by adjust_cpus are queued and then written from up to
+ * hotplug_threads threads at once (-p). How much they overlap depends on how much
+ * the kernel serializes hotplug. Every transition is timed and each batch logs
+ * the minimum, median and maximum latency.
+ */
+static unsigned hotplug_threads = 1;	/* -p option */
+static struct {
+	unsigned *cpus;
+	double *secs;
+	unsigned n;
+	unsigned next;		/* index of next cpu to change, atomic */
+	char online_state;
+} hotplug_batch;
+
+static void *hotplug_worker(void *arg)
+{
+	struct timespec start;
+	unsigned i;
+
+	(void)arg;
+	while ((i = __atomic_fetch_add(&hotplug_batch.next, 1, __ATOMIC_RELAXED)) < hotplug_batch.n) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		set_cpu_online_state(hotplug_batch.cpus[i], hotplug_batch.online_state);
+		hotplug_batch.secs[i] = elapsed_since(&start);
+	}
+	return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void flush_hotplug(char *cmdstr)
+{
+	pthread_t *tids;
+	struct timespec start;
+	unsigned nthreads, started, i;
+	double secs;
+
+	if (hotplug_batch.n == 0)
+		return;
+	if (wastebin_cpu_backend == CPU_CPUSET) {
+		/* the whole set is written at once */
+		apply_cpuset(cmdstr);
+		hotplug_batch.n = 0;
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	hotplug_batch.next = 0;
+	nthreads = hotplug_threads < hotplug_batch.n ? hotplug_threads : hotplug_batch.n;
+	tids = calloc_or_exit(nthreads, sizeof(*tids));
+	for (started = 0; nthreads > 1 && started < nthreads; started++)
+		if (pthread_create(&tids[started], NULL, hotplug_worker, NULL) != 0)
+			break;
+	if (started == 0)
+		hotplug_worker(NULL);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	secs = elapsed_since(&start);
+
+	for (i = 0; i < hotplug_batch.n; i++)
+		log_event(hotplug_batch.online_state ? EV_ONLINE : EV_OFFLINE,
+			  hotplug_batch.cpus[i], hotplug_batch.secs[i], cmdstr);
+	qsort(hotplug_batch.secs, hotplug_batch.n, sizeof(double), compare_double);
+	printf("%s: took %u cpus %s in %.3f s, latency min %.1f median %.1f max %.1f ms\n",
+	       cmdstr, hotplug_batch.n, hotplug_batch.online_state ? "online" : "offline", secs,
+	       hotplug_batch.secs[0] * 1e3, hotplug_batch.secs[hotplug_batch.n / 2] * 1e3,
+	       hotplug_batch.secs[hotplug_batch.n - 1] * 1e3);
+	fflush(stdout);
+	hotplug_batch.n = 0;
+}
+
+static void queue_hotplug(unsigned cpu, char online_state, char *cmdstr)
+{
+	if (hotplug_batch.cpus == NULL) {
+		hotplug_batch.cpus = calloc_or_exit(nr_cpu_ids, sizeof(unsigned));
+		hotplug_batch.secs = calloc_or_exit(nr_cpu_ids, sizeof(double));
+	}
+	if (hotplug_batch.n > 0 && hotplug_batch.online_state != online_state)
+		flush_hotplug(cmdstr);
+	hotplug_batch.online_state = online_state;
+	hotplug_batch.cpus[hotplug_batch.n++] = cpu;
+}
+
+/*
+ * sort key of a cpu that could be taken under the current policy, the candidate
+ * with the lowest key is taken next. partial is 0 if the cpu's core already has
+ * a thread taken, so cores are emptied whole
+ */
+static void policy_key(unsigned cpu, unsigned *core_taken, unsigned *pkg_taken, long key[4])
+{
+	long partial = core_taken[cpu_core[cpu]] ? 0 : 1;
+	long hi = -(long)cpu;
+
+	switch (wastebin_cpu_policy) {
+	case POLICY_HIGHEST:
+		key[0] = 0; key[1] = 0; key[2] = 0; key[3] = hi;
+		break;
+	case POLICY_CORES:
+		key[0] = partial; key[1] = -(long)cpu_package[cpu];
+		key[2] = -(long)cpu_core[cpu]; key[3] = hi;
+		break;
+	case POLICY_SMT:
+		key[0] = cpu_thread[cpu] == 0; key[1] = 0; key[2] = 0; key[3] = hi;
+		break;
+	case POLICY_SPREAD:
+		key[0] = partial; key[1] = pkg_taken[cpu_package[cpu]];
+		key[2] = -(long)cpu_package[cpu]; key[3] = hi;
+		break;
+	case POLICY_SOCKET:
+		key[0] = -(long)cpu_package[cpu]; key[1] = partial;
+		key[2] = -(long)cpu_core[cpu]; key[3] = hi;
+		break;
+	}
+}
+
+static int key_less(long *a, long *b)
+{
+	for (int i = 0; i < 4; i++)
+		if (a[i] != b[i])
+			return a[i] < b[i];
+	return 0;
+}
+
+/*
+ * choose the next cpu to take, or return nr_cpu_ids if none is left. cpus that
+ * can't go offline are only candidates with any_cpu, for uses that don't need to
+ */
+static unsigned pick_cpu(int any_cpu)
+{
+	static unsigned *core_taken, *pkg_taken;
+	long key[4], best_key[4];
+	unsigned best = nr_cpu_ids, cpu, i;
+
+	if (core_taken == NULL) {
+		core_taken = calloc_or_exit(nr_cpu_ids, sizeof(unsigned));
+		pkg_taken = calloc_or_exit(nr_cpu_ids, sizeof(unsigned));
+	}
+	/* count from scratch, cpus given back since the last call leave counts behind */
+	memset(core_taken, 0, nr_cpu_ids * sizeof(unsigned));
+	memset(pkg_taken, 0, nr_cpu_ids * sizeof(unsigned));
+	for (i = 0; i < wastebin_cpus_taken; i++) {
+		core_taken[cpu_core[cpus_taken_order[i]]]++;
+		pkg_taken[cpu_package[cpus_taken_order[i]]]++;
+	}
+	for_each_id(cpu, cpus_online, nr_cpu_ids) {
+		if (id_in_set(cpus_fixed, cpu) && !any_cpu)
+			continue;
+		policy_key(cpu, core_taken, pkg_taken, key);
+		if (best == nr_cpu_ids || key_less(key, best_key)) {
+			best = cpu;
+			memcpy(best_key, key, sizeof(key));
+		}
+	}
+	return best;
+}
+
+/* what could be taken, the cpus taken and those online that can go offline */
+static long max_cpus_taken(void)
+{
+	long n = wastebin_cpus_taken;
+	unsigned cpu;
+
+	for_each_id(cpu, cpus_online, nr_cpu_ids)
+		if (!id_in_set(cpus_fixed, cpu))
+			n++;
+	return n;
+}
+
+static void take_cpu(unsigned cpu, char *cmdstr)
+{
+	del_id(cpus_online, cpu);
+	add_id(cpus_taken, cpu);
+	cpus_taken_order[wastebin_cpus_taken++] = cpu;
+	queue_hotplug(cpu, 0, cmdstr);
+}
+
+/* put back the cpu at position idx of the taken order */
+static void release_cpu(unsigned idx, char *cmdstr)
+{
+	unsigned cpu = cpus_taken_order[idx];
+	memmove(&cpus_taken_order[idx], &cpus_taken_order[idx + 1],
+		(wastebin_cpus_taken - idx - 1) * sizeof(cpus_taken_order[0]));
+	wastebin_cpus_taken -= 1;
+	del_id(cpus_taken, cpu);
+	add_id(cpus_online, cpu);
+	queue_hotplug(cpu, 1, cmdstr);
+}
+
+static void adjust_cpus(struct wastebin_request *req, char *cmdstr)
+{
+	unsigned long *wanted = alloc_cpu_set();
+	unsigned n_taken;
+	unsigned cpu, idx;
+	n_taken = count_cpu_set(cpus_taken);
+	if (n_taken != wastebin_cpus_taken) {
+		fprintf(stderr, "%s: %u cpus taken != %u expected\n",
+			cmdstr, n_taken, wastebin_cpus_taken);
+		fail_exit("adjusting cpus taken", cmdstr);			
+	}
+		
+	if (req->cpulist[0] != '\0') {
+		/* the exact set asked for, most recently taken go back first */
+		parse_id_list(req->cpulist, strlen(req->cpulist), wanted, nr_cpu_ids);
+		printf("%s: adjust cpus taken to %s\n", cmdstr, req->cpulist);
+		for (idx = wastebin_cpus_taken; idx-- > 0;)
+			if (!id_in_set(wanted, cpus_taken_order[idx]))
+				release_cpu(idx, cmdstr);
+		for_each_id(cpu, wanted, nr_cpu_ids) {
+			if (id_in_set(cpus_taken, cpu))
+				continue;
+			if (!id_in_set(cpus_online, cpu) || id_in_set(cpus_fixed, cpu))
+				fprintf(stderr, "%s: cpu %u can't be taken offline\n", cmdstr, cpu);
+			else
+				take_cpu(cpu, cmdstr);
+		}
+	} else {
+		if (req->cpus != n_taken)
+			printf("%s: adjust cpus taken to %ld\n", cmdstr, req->cpus);
+		/* take some online cpus offline */
+		while (wastebin_cpus_taken < req->cpus) {
+			cpu = pick_cpu(0);
+			if (cpu == nr_cpu_ids) {
+				fprintf(stderr, "%s: only %u cpus can be taken, not %ld\n", cmdstr,
+					wastebin_cpus_taken, req->cpus);
+				break;
+			}
+			take_cpu(cpu, cmdstr);
+		}
+		/* put some taken cpus back online */
+		while (wastebin_cpus_taken > req->cpus)
+			release_cpu(wastebin_cpus_taken - 1, cmdstr);
+	}
+	free(wanted);
+	flush_hotplug(cmdstr);
+	show_cpu_set("taken", cpus_taken);
+}
+
+/*
+ * <ncpus> is a count or a list of cpus to take, optionally followed by +<k>x<f>
+ * for <k> cpus each fractionally used <f> of the time, or it is <n>.<d> for <n>
+ * cpus taken and one more used .<d> of the time. returns 0, or -1 if invalid
+ */
+static int parse_cpuarg(char *arg, struct wastebin_request *req)
+{
+	char whole[strlen(arg) + 1];
+	char *plus, *endp;
+	long k;
+	double frac;
+	int rel = parse_target(arg, 0, &req->cpus, &req->cpus_target, &req->cpus_pct);
+
+	if (rel != 0)
+		return rel < 0 ? -1 : 0;
+	strcpy(whole, arg);
+	plus = strchr(whole, '+');
+	if (plus != NULL) {
+		*plus = '\0';
+		k = strtol(plus + 1, &endp, 10);
+		if (plus == whole || k <= 0 || k > nr_cpu_ids || *endp != 'x')
+			return -1;
+		frac = strtod(endp + 1, &endp);
+		if (*endp != '\0' || !(frac > 0 && frac <= 1))
+			return -1;
+		req->burners = k;
+		req->burn_fraction = frac;
+	} else if ((plus = strchr(whole, '.')) != NULL) {
+		frac = strtod(plus, &endp);
+		if (*endp != '\0' || frac < 0 || plus == whole)
+			return -1;
+		*plus = '\0';
+		if (frac > 0) {
+			req->burners = 1;
+			req->burn_fraction = frac;
+		}
+	}
+	if (strpbrk(whole, ",-") != NULL) {
+		unsigned long *wanted = alloc_cpu_set();
+		int bad = parse_id_list(whole, strlen(whole), wanted, nr_cpu_ids) < 0;
+		/* send it compacted, so any list of ranges that fits will do */
+		if (format_id_list(wanted, nr_cpu_ids, req->cpulist, sizeof(req->cpulist)) >=
+		    sizeof(req->cpulist))
+			bad = 1;
+		req->cpus = count_cpu_set(wanted);
+		free(wanted);
+		if (bad)
+			return -1;
+	} else {
+		req->cpus = str2ul(whole);
+	}
+	return req->cpus < 0 ? -1 : 0;
+}
+
+/*
+ * Fractional cpus. Hotplug and cpusets take whole cpus, so a fraction of a cpu is
+ * taken by a burner thread that spins on a cpu for part of each 10 ms period.
+ * Burners are pinned to the cpus the selection policy would take next, as if those
+ * were partly taken. A burner first tries SCHED_DEADLINE, which the kernel only
+ * allows for a pinned thread in an exclusive cpuset, then falls back to a
+ * SCHED_FIFO duty cycle, and, without privilege, a duty cycle at normal priority.
+ */
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#define burn_period_ns 10000000L
+struct wastebin_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+struct burner {
+	pthread_t tid;
+	unsigned cpu;
+	double fraction;
+	int stop;		/* set to make the burner exit, atomic */
+};
+static struct burner *burners;	/* room for nr_cpu_ids */
+static unsigned wastebin_burners = 0;
+
+static void timespec_add_ns(struct timespec *t, long ns)
+{
+	t->tv_nsec += ns;
+	while (t->tv_nsec >= 1000000000L) {
+		t->tv_nsec -= 1000000000L;
+		t->tv_sec += 1;
+	}
+}
+
+static void *burner_main(void *arg)
+{
+	struct burner *b = arg;
+	struct wastebin_sched_attr attr = { sizeof(attr), SCHED_DEADLINE, 0, 0, 0,
+		b->fraction * burn_period_ns, burn_period_ns, burn_period_ns };
+	struct sched_param param = { 1 };
+	struct timespec next, busy_until, now;
+	const char *how;
+
+	if (syscall(SYS_sched_setattr, 0, &attr, 0) == 0) {
+		/* the kernel throttles us to the runtime, just spin */
+		printf("burning %.2f of cpu %u with SCHED_DEADLINE\n", b->fraction, b->cpu);
+		fflush(stdout);
+		while (!__atomic_load_n(&b->stop, __ATOMIC_RELAXED))
+			;
+		return NULL;
+	}
+	how = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0 ?
+		"SCHED_FIFO" : "normal priority";
+	printf("burning %.2f of cpu %u with a %s duty cycle\n", b->fraction, b->cpu, how);
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!__atomic_load_n(&b->stop, __ATOMIC_RELAXED)) {
+		busy_until = next;
+		timespec_add_ns(&busy_until, b->fraction * burn_period_ns);
+		timespec_add_ns(&next, burn_period_ns);
+		do
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		while (now.tv_sec < busy_until.tv_sec ||
+		       (now.tv_sec == busy_until.tv_sec && now.tv_nsec < busy_until.tv_nsec));
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	return NULL;
+}
+
+static void stop_burners(void)
+{
+	for (unsigned i = 0; i < wastebin_burners; i++)
+		__atomic_store_n(&burners[i].stop, 1, __ATOMIC_RELAXED);
+	for (unsigned i = 0; i < wastebin_burners; i++)
+		pthread_join(burners[i].tid, NULL);
+	wastebin_burners = 0;
+}
+
+/* the next n cpus the policy would take, without taking them. returns how many */
+static unsigned next_cpus(unsigned n, unsigned *cpus)
+{
+	unsigned found, i;
+	for (found = 0; found < n; found++) {
+		cpus[found] = pick_cpu(1);
+		if (cpus[found] == nr_cpu_ids)
+			break;
+		del_id(cpus_online, cpus[found]);
+		cpus_taken_order[wastebin_cpus_taken++] = cpus[found];
+	}
+	for (i = 0; i < found; i++)
+		add_id(cpus_online, cpus[i]);
+	wastebin_cpus_taken -= found;
+	return found;
+}
+
+static void adjust_burners(struct wastebin_request *req, char *cmdstr)
+{
+	static unsigned *cpus;
+	unsigned n, i, had = wastebin_burners;
+	pthread_attr_t attr;
+
+	if (burners == NULL) {
+		burners = calloc_or_exit(nr_cpu_ids, sizeof(*burners));
+		cpus = calloc_or_exit(nr_cpu_ids, sizeof(*cpus));
+	}
+	n = next_cpus(req->burners, cpus);
+	if (n < (unsigned)req->burners)
+		fprintf(stderr, "%s: only %u cpus left to burn\n", cmdstr, n);
+	/* leave the burners alone if they already are what was asked */
+	for (i = 0; i < n && n == wastebin_burners; i++)
+		if (burners[i].cpu != cpus[i] || burners[i].fraction != req->burn_fraction)
+			break;
+	if (i == n && n == wastebin_burners)
+		return;
+	stop_burners();
+	for (i = 0; i < n; i++) {
+		burners[i] = (struct burner){ 0, cpus[i], req->burn_fraction, 0 };
+		pthread_attr_init(&attr);
+		pin_thread_attr(&attr, cpus[i]);
+		if (pthread_create(&burners[i].tid, &attr, burner_main, &burners[i]) != 0) {
+			pthread_attr_destroy(&attr);
+			fprintf(stderr, "%s: can't start burner for cpu %u\n", cmdstr, cpus[i]);
+			break;
+		}
+		pthread_attr_destroy(&attr);
+		wastebin_burners++;
+	}
+	if (n > 0 || had > 0)
+		printf("%s: %u cpus partly used, %.2f each\n", cmdstr, wastebin_burners,
+		       req->burn_fraction);
+}
+
+/*
+ * Cache (-L). A smaller part has less last level cache, so a request may also
+ * take cache ways away from everything else on the machine, by resctrl cache
+ * allocation (Intel CAT, AMD L3 QoS). The L3 capacity bitmask of the default
+ * group, and of every other control group, is cut down to the lowest ways that
+ * remain, in every cache domain, and put back as it was once no cache is taken.
+ * -L takes <n>w for a number of ways, or a size that is rounded to whole ways.
+ * resctrl is mounted if it isn't already, and is only touched once asked to.
+ */
+#define resctrl_dir "/sys/fs/resctrl"
+struct resctrl_group {
+	char path[PATH_MAX];	/* schemata file of the group */
+	char saved_l3[1024];	/* its L3 line before anything was taken, or "" */
+	char saved_mb[1024];	/* its MB line */
+};
+static struct resctrl_group *resctrl_groups = NULL;
+static unsigned resctrl_ngroups = 0;
+static int resctrl_state = 0;		/* 1 once groups are known, -1 if no resctrl */
+static int llc_ways = 0;		/* ways in the cache, once inventoried */
+static int llc_min_ways = 1;
+static unsigned long llc_way_bytes = 0;
+static int llc_ways_taken = 0;
+static int llc_unavailable = 0;
+
+/* -L argument */
+static int parse_cachearg(char *arg, struct wastebin_request *req)
+{
+	size_t len = strlen(arg);
+	char ways[32];
+
+	if (len > 1 && len < sizeof(ways) && arg[len - 1] == 'w') {
+		memcpy(ways, arg, len - 1);
+		ways[len - 1] = '\0';
+		req->cache_ways = str2ul(ways);
+		return req->cache_ways <= 0 ? -1 : 0;
+	}
+	req->cache_bytes = strm2ul(arg);
+	return req->cache_bytes < 0 ? -1 : 0;
+}
+
+/* find the line for resource prefix (such as "L3:") in a schemata file */
+static void read_schemata(char *path, char *prefix, char *line, size_t len)
+{
+	char buf[1024];
+	FILE *fh = fopen(path, "r");
+
+	line[0] = '\0';
+	if (fh == NULL)
+		return;
+	while (line[0] == '\0' && fgets(buf, sizeof(buf), fh) != NULL) {
+		char *l = buf + strspn(buf, " \t");
+		l[strcspn(l, "\n")] = '\0';
+		if (strncmp(l, prefix, strlen(prefix)) == 0 && strlen(l) < len)
+			strcpy(line, l);
+	}
+	fclose(fh);
+}
+
+static void add_resctrl_group(char *dir, char *cmdstr)
+{
+	struct resctrl_group *g;
+
+	resctrl_groups = realloc(resctrl_groups, (resctrl_ngroups + 1) * sizeof(*resctrl_groups));
+	if (resctrl_groups == NULL)
+		fail_exit("allocating resctrl groups", cmdstr);
+	g = &resctrl_groups[resctrl_ngroups];
+	snprintf(g->path, sizeof(g->path), "%s/schemata", dir);
+	if (access(g->path, W_OK) != 0)
+		return;
+	read_schemata(g->path, "L3:", g->saved_l3, sizeof(g->saved_l3));
+	read_schemata(g->path, "MB:", g->saved_mb, sizeof(g->saved_mb));
+	resctrl_ngroups++;
+}
+
+/* find the default group and the control groups, returns 0 or -1 without resctrl */
+static int inventory_resctrl(char *cmdstr)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+
+	if (resctrl_state != 0)
+		return resctrl_state < 0 ? -1 : 0;
+	resctrl_state = -1;
+	if (access(resctrl_dir "/info", F_OK) != 0)
+		mount("resctrl", resctrl_dir, "resctrl", 0, NULL);
+	if (access(resctrl_dir "/info", F_OK) != 0) {
+		fprintf(stderr, "%s: no resctrl at %s\n", cmdstr, resctrl_dir);
+		return -1;
+	}
+	add_resctrl_group(resctrl_dir, cmdstr);
+	dir = opendir(resctrl_dir);
+	while (dir != NULL && (de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.' || strcmp(de->d_name, "info") == 0 ||
+		    strcmp(de->d_name, "mon_groups") == 0 || strcmp(de->d_name, "mon_data") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", resctrl_dir, de->d_name);
+		add_resctrl_group(path, cmdstr);
+	}
+	if (dir != NULL)
+		closedir(dir);
+	resctrl_state = 1;
+	return 0;
+}
+
+/*
+ * write a resource line to every group that has one, from its saved line with
+ * each domain's value passed through limit
+ */
+static void write_schemata(int mb, unsigned long (*limit)(unsigned long, unsigned long),
+			   unsigned long arg, char *cmdstr)
+{
+	char line[2048], *item, *save;
+	unsigned long value;
+	size_t at;
+	unsigned id;
+
+	for (unsigned i = 0; i < resctrl_ngroups; i++) {
+		struct resctrl_group *g = &resctrl_groups[i];
+		char *saved = mb ? g->saved_mb : g->saved_l3;
+		char copy[sizeof(g->saved_l3)];
+
+		if (saved[0] == '\0')
+			continue;
+		if (limit == NULL) {
+			snprintf(line, sizeof(line), "%s\n", saved);
+		} else {
+			strcpy(copy, saved + 3);
+			at = snprintf(line, sizeof(line), "%.3s", saved);
+			for (item = strtok_r(copy, ";", &save); item != NULL;
+			     item = strtok_r(NULL, ";", &save)) {
+				if (sscanf(item, mb ? "%u=%lu" : "%u=%lx", &id, &value) != 2)
+					continue;
+				at += snprintf(line + at, sizeof(line) - at, mb ? "%s%u=%lu" : "%s%u=%lx",
+					       line[at - 1] == ':' ? "" : ";", id, limit(value, arg));
+			}
+			snprintf(line + at, sizeof(line) - at, "\n");
+		}
+		if (write_file(g->path, line) < 0)
+			fprintf(stderr, "%s: writing %s to %s: %s\n", cmdstr, line, g->path,
+				strerror(errno));
+	}
+}
+
+/* bytes of L3 cache, or -1 if sysfs doesn't say */
+static long llc_size(void)
+{
+	char buf[64], path[PATH_MAX];
+	long size = -1;
+
+	for (int i = 0; i < 10 && size < 0; i++)
+		if (read_sysfs_long("/sys/devices/system/cpu/cpu0/cache/index%d/level", i) == 3) {
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+			if (read_file(path, buf, sizeof(buf)) == 0)
+				size = strm2ul(buf);
+		}
+	return size;
+}
+
+/* returns 0, or -1 if cache allocation can't be used */
+static int inventory_llc(char *cmdstr)
+{
+	char buf[64];
+	long size;
+
+	if (llc_ways > 0 || llc_unavailable)
+		return llc_unavailable ? -1 : 0;
+	llc_unavailable = 1;
+	if (inventory_resctrl(cmdstr) < 0)
+		return -1;
+	if (read_file(resctrl_dir "/info/L3/cbm_mask", buf, sizeof(buf)) < 0) {
+		fprintf(stderr, "%s: no L3 cache allocation in %s, not taking cache\n",
+			cmdstr, resctrl_dir);
+		return -1;
+	}
+	llc_ways = __builtin_popcountl(strtoul(buf, NULL, 16));
+	if (read_file(resctrl_dir "/info/L3/min_cbm_bits", buf, sizeof(buf)) == 0)
+		llc_min_ways = atoi(buf) > 0 ? atoi(buf) : 1;
+	size = llc_size();
+	llc_way_bytes = size > 0 ? size / llc_ways : 0;
+	llc_unavailable = 0;
+	printf("%s: L3 cache has %d ways of %'lu bytes\n", cmdstr, llc_ways, llc_way_bytes);
+	return 0;
+}
+
+/* a group's mask cut down to the allowed ways, or all of them if too few are left */
+static unsigned long limit_ways(unsigned long mask, unsigned long allowed)
+{
+	mask &= allowed;
+	return __builtin_popcountl(mask) < llc_min_ways ? allowed : mask;
+}
+
+static void adjust_llc(struct wastebin_request *req, char *cmdstr)
+{
+	int taken;
+
+	if (req->cache_ways == 0 && req->cache_bytes == 0 && llc_ways_taken == 0)
+		return;
+	if (inventory_llc(cmdstr) < 0)
+		return;
+	taken = req->cache_ways;
+	if (taken == 0 && req->cache_bytes > 0)
+		taken = llc_way_bytes ? (req->cache_bytes + llc_way_bytes / 2) / llc_way_bytes : 0;
+	if (taken > llc_ways - llc_min_ways)
+		taken = llc_ways - llc_min_ways;
+	if (taken == llc_ways_taken)
+		return;
+	write_schemata(0, taken ? limit_ways : NULL, (1UL << (llc_ways - taken)) - 1, cmdstr);
+	llc_ways_taken = taken;
+	printf("%s: taking %d of %d L3 cache ways, %'lu bytes\n", cmdstr, taken, llc_ways,
+	       taken * llc_way_bytes);
+	fflush(stdout);
+}
+
+/*
+ * Memory bandwidth (-B). A smaller instance also has less DRAM bandwidth, so a
+ * request may take a percentage of it. With resctrl memory bandwidth allocation
+ * every group is throttled to what remains, in steps of bandwidth_gran and no
+ * lower than min_bandwidth. Without MBA, and only with the cpuset backend, where
+ * taken cpus are still online, streaming threads on the taken cpus consume the
+ * bandwidth instead. Their duty cycle is calibrated by bisection against a
+ * STREAM-like triad probe run on every cpu that is not taken, which also
+ * measures the full bandwidth before anything is taken and the reduction
+ * achieved. The probe's arrays, and the streamers' buffers, are sized to add up
+ * to llc_multiple times the L3 cache, enough to go to DRAM without mapping more
+ * than needed. The streamers' buffers count as memory taken.
+ */
+#define llc_multiple 4
+#define llc_default_bytes (32L << 20)	/* if sysfs has no L3 size */
+#define stream_min_bytes (1L << 20)
+static size_t stream_buffer_bytes = 0;	/* of each streamer */
+static int mba_state = 0;		/* 1 with MBA, -1 without, 0 unknown */
+static int mba_min = 10, mba_gran = 10;
+static int bandwidth_taken = 0;		/* percent */
+static double bandwidth_baseline = 0;	/* bytes/s measured before taking any */
+static struct streamer {
+	pthread_t tid;
+	unsigned cpu;
+	double *buf;
+} *streamers;
+static unsigned wastebin_streamers = 0;
+static volatile double stream_fraction = 0;	/* duty cycle of the streamers */
+static int streamers_stop = 0;
+static unsigned long *streamers_cpus;	/* taken cpus the streamers were set up on */
+
+struct probe_job {
+	double *a, *b, *c;
+	size_t n;
+	double secs;
+};
+
+/* bytes for each of n buffers, so that they add up to llc_multiple times the LLC */
+static size_t stream_share(unsigned n)
+{
+	long llc = llc_size();
+	size_t share = llc_multiple * (llc > 0 ? llc : llc_default_bytes) / (n > 0 ? n : 1);
+
+	share = (share + 4095) & ~4095UL;
+	return share > stream_min_bytes ? share : stream_min_bytes;
+}
+
+static void *probe_worker(void *arg)
+{
+	struct probe_job *job = arg;
+	double *restrict a = job->a, *restrict b = job->b, *restrict c = job->c;
+	struct timespec start;
+
+	for (size_t i = 0; i < job->n; i++)	/* fault in */
+		a[i] = 0, b[i] = 1, c[i] = 2;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int pass = 0; pass < 4; pass++)
+		for (size_t i = 0; i < job->n; i++)
+			a[i] = b[i] + 3.0 * c[i];
+	job->secs = elapsed_since(&start);
+	return NULL;
+}
+
+/* triad bandwidth in bytes/s on all the cpus not taken */
+static double probe_bandwidth(char *cmdstr)
+{
+	struct probe_job *jobs;
+	pthread_t *tids;
+	pthread_attr_t attr;
+	unsigned n = 0, nprobe = 0, cpu;
+	size_t array_bytes;
+	double bytes = 0, secs = 0;
+	char *mem;
+
+	for_each_id(cpu, cpus_online, nr_cpu_ids)
+		if (!id_in_set(cpus_taken, cpu))
+			nprobe++;
+	if (nprobe == 0)
+		return 0;
+	array_bytes = stream_share(3 * nprobe);
+	jobs = calloc_or_exit(nprobe, sizeof(*jobs));
+	tids = calloc_or_exit(nprobe, sizeof(*tids));
+	mem = mmap(NULL, nprobe * 3 * array_bytes, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		fail_exit("allocating bandwidth probe", cmdstr);
+	for_each_id(cpu, cpus_online, nr_cpu_ids) {
+		struct probe_job *job = &jobs[n];
+		if (n == nprobe)
+			break;
+		if (id_in_set(cpus_taken, cpu))
+			continue;
+		job->a = (double *)(mem + 3 * n * array_bytes);
+		job->b = job->a + array_bytes / sizeof(double);
+		job->c = job->b + array_bytes / sizeof(double);
+		job->n = array_bytes / sizeof(double);
+		pthread_attr_init(&attr);
+		pin_thread_attr(&attr, cpu);
+		if (pthread_create(&tids[n], &attr, probe_worker, job) == 0)
+			n++;
+		pthread_attr_destroy(&attr);
+	}
+	for (unsigned i = 0; i < n; i++) {
+		pthread_join(tids[i], NULL);
+		bytes += 4.0 * 3 * array_bytes;
+		if (jobs[i].secs > secs)
+			secs = jobs[i].secs;
+	}
+	munmap(mem, nprobe * 3 * array_bytes);
+	free(jobs);
+	free(tids);
+	return secs > 0 ? bytes / secs : 0;
+}
+
+static void *streamer_main(void *arg)
+{
+	struct streamer *st = arg;
+	size_t n = stream_buffer_bytes / sizeof(double) / 2;
+	double *restrict src = st->buf, *restrict dst = st->buf + n;
+	struct timespec next, busy_until, now;
+	double fraction;
+
+	for (size_t i = 0; i < 2 * n; i++)
+		st->buf[i] = i;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!__atomic_load_n(&streamers_stop, __ATOMIC_RELAXED)) {
+		fraction = stream_fraction;
+		busy_until = next;
+		timespec_add_ns(&busy_until, fraction * burn_period_ns);
+		timespec_add_ns(&next, burn_period_ns);
+		/* copy in slices, so the duty cycle is kept to a fraction of a period */
+		for (size_t at = 0; ; at = (at + 65536) % n) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > busy_until.tv_sec ||
+			    (now.tv_sec == busy_until.tv_sec && now.tv_nsec >= busy_until.tv_nsec))
+				break;
+			memcpy(dst + at, src + at, 65536 * sizeof(double) > (n - at) * sizeof(double) ?
+			       (n - at) * sizeof(double) : 65536 * sizeof(double));
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	return NULL;
+}
+
+static void stop_streamers(void)
+{
+	__atomic_store_n(&streamers_stop, 1, __ATOMIC_RELAXED);
+	for (unsigned i = 0; i < wastebin_streamers; i++) {
+		pthread_join(streamers[i].tid, NULL);
+		munmap(streamers[i].buf, stream_buffer_bytes);
+	}
+	wastebin_streamers = 0;
+	wastebin_memory_streaming = 0;
+	streamers_stop = 0;
+}
+
+static void start_streamers(char *cmdstr)
+{
+	pthread_attr_t attr;
+	unsigned cpu;
+
+	if (streamers == NULL) {
+		streamers = calloc_or_exit(nr_cpu_ids, sizeof(*streamers));
+		streamers_cpus = alloc_cpu_set();
+	}
+	memcpy(streamers_cpus, cpus_taken, set_words(nr_cpu_ids) * sizeof(unsigned long));
+	stream_buffer_bytes = stream_share(count_cpu_set(cpus_taken));
+	for_each_id(cpu, cpus_taken, nr_cpu_ids) {
+		struct streamer *st = &streamers[wastebin_streamers];
+		st->cpu = cpu;
+		st->buf = mmap(NULL, stream_buffer_bytes, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (st->buf == MAP_FAILED)
+			fail_exit("allocating streaming buffer", cmdstr);
+		pthread_attr_init(&attr);
+		pin_thread_attr(&attr, cpu);
+		if (pthread_create(&st->tid, &attr, streamer_main, st) == 0)
+			wastebin_streamers++;
+		else
+			munmap(st->buf, stream_buffer_bytes);
+		pthread_attr_destroy(&attr);
+	}
+	wastebin_memory_streaming = wastebin_streamers * stream_buffer_bytes;
+	printf("%s: %u streaming threads with %'lu bytes of buffers, counted as taken\n",
+	       cmdstr, wastebin_streamers, wastebin_memory_streaming);
+}
+
+/* find the streamers' duty cycle that leaves (100 - pct)% of the baseline */
+static double calibrate_streamers(int pct, char *cmdstr)
+{
+	double target = bandwidth_baseline * (100 - pct) / 100, lo = 0, hi = 1, bw;
+
+	stream_fraction = 1.0;
+	bw = probe_bandwidth(cmdstr);
+	if (bw > target) {
+		fprintf(stderr, "%s: %u streaming threads can only take %.0f%% of the bandwidth\n",
+			cmdstr, wastebin_streamers, 100 * (1 - bw / bandwidth_baseline));
+		return bw;
+	}
+	for (int i = 0; i < 6; i++) {
+		double mid = (lo + hi) / 2;
+		stream_fraction = mid;
+		if (probe_bandwidth(cmdstr) > target)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	stream_fraction = hi;
+	printf("%s: %u streaming threads on taken cpus busy %.0f%% of the time\n", cmdstr,
+	       wastebin_streamers, hi * 100);
+	return probe_bandwidth(cmdstr);
+}
+
+/* an MB value cut down to the allowed percentage */
+static unsigned long limit_bandwidth(unsigned long value, unsigned long allowed)
+{
+	return value < allowed ? value : allowed;
+}
+
+static void adjust_bandwidth(struct wastebin_request *req, char *cmdstr)
+{
+	char buf[64];
+	int pct = req->bandwidth_pct, allowed;
+	double bw;
+
+	if (pct == bandwidth_taken && (wastebin_streamers == 0 ||
+	    memcmp(streamers_cpus, cpus_taken, set_words(nr_cpu_ids) * sizeof(long)) == 0))
+		return;
+	if (mba_state == 0) {
+		mba_state = -1;
+		if (inventory_resctrl(cmdstr) == 0 &&
+		    read_file(resctrl_dir "/info/MB/min_bandwidth", buf, sizeof(buf)) == 0) {
+			mba_min = atoi(buf);
+			if (read_file(resctrl_dir "/info/MB/bandwidth_gran", buf, sizeof(buf)) == 0 &&
+			    atoi(buf) > 0)
+				mba_gran = atoi(buf);
+			mba_state = 1;
+		}
+		bandwidth_baseline = probe_bandwidth(cmdstr);
+		printf("%s: memory bandwidth %.2f GB/s before taking any, %s\n", cmdstr,
+		       bandwidth_baseline / 1e9, mba_state > 0 ? "throttling with MBA" :
+		       "no MBA, using streaming threads");
+	}
+	stop_streamers();
+	if (pct == 0) {
+		if (mba_state > 0 && bandwidth_taken > 0)
+			write_schemata(1, NULL, 0, cmdstr);
+		bandwidth_taken = 0;
+		printf("%s: not taking memory bandwidth\n", cmdstr);
+		fflush(stdout);
+		return;
+	}
+	if (mba_state > 0) {
+		/* round what is left up to the granularity */
+		allowed = (100 - pct + mba_gran - 1) / mba_gran * mba_gran;
+		if (allowed < mba_min)
+			allowed = mba_min;
+		write_schemata(1, limit_bandwidth, allowed, cmdstr);
+		bw = probe_bandwidth(cmdstr);
+	} else if (wastebin_cpu_backend == CPU_CPUSET && wastebin_cpus_taken > 0) {
+		start_streamers(cmdstr);
+		bw = calibrate_streamers(pct, cmdstr);
+	} else {
+		fprintf(stderr, "%s: taking memory bandwidth needs MBA, or taken cpus that are "
+			"still online with --cpu-backend=cpuset\n", cmdstr);
+		bandwidth_taken = 0;
+		return;
+	}
+	bandwidth_taken = pct;
+	printf("%s: memory bandwidth now %.2f GB/s, %.0f%% below the %.2f GB/s baseline, "
+	       "asked for %d%%\n", cmdstr, bw / 1e9, 100 * (1 - bw / bandwidth_baseline),
+	       bandwidth_baseline / 1e9, pct);
+	fflush(stdout);
+}
+
+/*
+ * Status page. The daemon publishes its state in a small shared file,
+ * /tmp/wastebin.stat, that monitors map and read without talking to the daemon
+ * or parsing the log. Updates follow a sequence lock: seq is odd while the
+ * daemon is writing, so a reader copies the page between two reads of an equal,
+ * even seq. The layout only grows at the end, and version changes if it must
+ * change otherwise. 'wastebin -s' is a reader.
+ */
+#define status_page_path "/tmp/wastebin.stat"
+#define status_magic 0x74736277	/* "wbst" */
+#define status_version 2
+enum wastebin_phase { PHASE_IDLE, PHASE_CPUS, PHASE_LOCKING, PHASE_RELEASING, PHASE_EXITED };
+static const char *phase_names[] = { "idle", "adjusting cpus", "locking", "releasing", "exited" };
+struct wastebin_stat {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;		/* odd while an update is in progress */
+	uint32_t phase;
+	int64_t pid;
+	int64_t update_ns;	/* CLOCK_MONOTONIC time of the last update */
+	int64_t target_membytes, membytes, max_membytes;
+	int64_t target_cpus, cpus, max_cpus;
+	int64_t progress_done, progress_total;	/* bytes of the lock or release under way */
+	uint32_t burners;
+	uint32_t ncpu_bits;	/* size of the cpus_taken bitmap */
+	double burn_fraction;
+	uint64_t cpus_taken[];	/* ncpu_bits bits, the page is sized to fit */
+};
+static struct wastebin_stat *status_page = NULL;
+static size_t status_page_size;
+static int progress_phase;		/* last phase published, for the trace */
+static size_t progress_done, progress_total;
+static struct wastebin_request *current_req;		/* request being applied */
+
+static void open_status_page(char *cmdstr)
+{
+	int fd = open(status_page_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+		      S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	status_page_size = sizeof(*status_page) + (nr_cpu_ids + 63) / 64 * sizeof(uint64_t);
+	if (fd < 0 || ftruncate(fd, status_page_size) < 0) {
+		fprintf(stderr, "%s: can't create %s\n", cmdstr, status_page_path);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	status_page = mmap(NULL, status_page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (status_page == MAP_FAILED) {
+		status_page = NULL;
+		return;
+	}
+	status_page->magic = status_magic;
+	status_page->version = status_version;
+	status_page->pid = getpid();
+	status_page->ncpu_bits = nr_cpu_ids;
+}
+
+static void publish_status(int phase, size_t done, size_t total)
+{
+	struct wastebin_stat *sp = status_page;
+	struct timespec now;
+	unsigned cpu;
+
+	__atomic_store_n(&progress_phase, phase, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_done, done, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_total, total, __ATOMIC_RELAXED);
+	if (sp == NULL)
+		return;
+	__atomic_store_n(&sp->seq, sp->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sp->phase = phase;
+	sp->update_ns = now.tv_sec * 1000000000L + now.tv_nsec;
+	sp->target_membytes = current_req ? current_req->membytes : 0;
+	sp->target_cpus = current_req ? current_req->cpus : 0;
+	sp->membytes = memory_wasted();
+	sp->max_membytes = wastebin_mem_max;
+	sp->cpus = wastebin_cpus_taken;
+	sp->max_cpus = max_cpus_taken();
+	sp->progress_done = done;
+	sp->progress_total = total;
+	sp->burners = wastebin_burners;
+	sp->burn_fraction = wastebin_burners ? burners[0].fraction : 0;
+	memset(sp->cpus_taken, 0, status_page_size - sizeof(*sp));
+	for_each_id(cpu, cpus_taken, nr_cpu_ids)
+		sp->cpus_taken[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&sp->seq, sp->seq + 1, __ATOMIC_RELAXED);
+}
+
+static void close_status_page(void)
+{
+	if (status_page == NULL)
+		return;
+	publish_status(PHASE_EXITED, 0, 0);
+	munmap(status_page, status_page_size);
+	status_page = NULL;
+	unlink(status_page_path);
+}
+
+/* print a consistent snapshot of the status page, as a monitor would read it */
+static int show_status_page(char *cmdstr)
+{
+	struct wastebin_stat *sp, *snap;
+	unsigned long *taken;
+	char *list;
+	struct stat st;
+	uint32_t seq;
+	unsigned cpu;
+	int fd;
+
+	fd = open(status_page_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		fail_exit("no status page, is the background process running?", cmdstr);
+	if ((size_t)st.st_size < sizeof(*sp))
+		fail_exit("status page is too short", cmdstr);
+	sp = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	snap = malloc(st.st_size);
+	if (sp == MAP_FAILED || snap == NULL)
+		fail_exit("mapping status page", cmdstr);
+	do {
+		while ((seq = __atomic_load_n(&sp->seq, __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+		memcpy(snap, sp, st.st_size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&sp->seq, __ATOMIC_RELAXED) != seq);
+	munmap(sp, st.st_size);
+	if (snap->magic != status_magic || snap->version != status_version ||
+	    sizeof(*sp) + (snap->ncpu_bits + 63) / 64 * sizeof(uint64_t) > (size_t)st.st_size)
+		fail_exit("status page has an unknown layout", cmdstr);
+
+	/* the page's words are 64 bits whatever the size of a long */
+	taken = calloc(set_words(snap->ncpu_bits) + 1, sizeof(unsigned long));
+	if (taken == NULL)
+		fail_exit("allocating cpu set", cmdstr);
+	for (size_t w = 0; w < (snap->ncpu_bits + 63) / 64; w++)
+		for (uint64_t bits = snap->cpus_taken[w]; bits != 0; bits &= bits - 1) {
+			cpu = w * 64 + __builtin_ctzll(bits);
+			if (cpu < snap->ncpu_bits)
+				add_id(taken, cpu);
+		}
+	printf("pid %ld %s", (long)snap->pid, snap->phase < PHASE_EXITED + 1 ?
+	       phase_names[snap->phase] : "unknown");
+	if (snap->progress_total)
+		printf(" %'ld of %'ld bytes", (long)snap->progress_done, (long)snap->progress_total);
+	printf("\nmemory %'ld of %'ld bytes, target %'ld\n", (long)snap->membytes,
+	       (long)snap->max_membytes, (long)snap->target_membytes);
+	list = id_list_string(taken, snap->ncpu_bits);
+	printf("cpus %ld of %ld, target %ld, taken %s\n", (long)snap->cpus, (long)snap->max_cpus,
+	       (long)snap->target_cpus, list[0] ? list : "none");
+	free(list);
+	if (snap->burners)
+		printf("burning %.2f of %u more cpus\n", snap->burn_fraction, snap->burners);
+	free(taken);
+	free(snap);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Tracing (-T). While the daemon adjusts, the kernel reclaims page cache, swaps
+ * and compacts to make room, and that is the cost a transition imposes on the
+ * workload. A sampler thread wakes when an adjustment starts and every
+ * trace_interval_ms (-I) until it ends appends a CSV row to the trace file with
+ * the phase, the lock progress, the reclaim, swap and compaction counters of
+ * /proc/vmstat as deltas since the previous row, and memory pressure. At the end
+ * of each adjustment the totals for the transition are logged.
+ */
+static char *trace_path = NULL;		/* -T option */
+static unsigned trace_interval_ms = 100; /* -I option */
+static FILE *trace_fh;
+static char *trace_cmdstr;
+static pthread_t trace_tid;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static int trace_active = 0, trace_quit = 0;
+static unsigned trace_starts = 0;	/* adjustments started, so none is missed */
+static struct timespec trace_epoch;
+
+static const char *trace_columns[] = {
+	"pgscan", "pgsteal", "pswpin", "pswpout", "compact_stall", "compact_fail",
+	"compact_success", "compact_migrate_scanned", "compact_free_scanned"
+};
+#define trace_ncolumns (sizeof(trace_columns) / sizeof(trace_columns[0]))
+/* the vmstat counters summed into each column */
+static const struct { const char *name; unsigned column; } trace_vmstat[] = {
+	{ "pgscan_kswapd", 0 }, { "pgscan_direct", 0 }, { "pgscan_khugepaged", 0 },
+	{ "pgscan_proactive", 0 }, { "pgsteal_kswapd", 1 }, { "pgsteal_direct", 1 },
+	{ "pgsteal_khugepaged", 1 }, { "pgsteal_proactive", 1 }, { "pswpin", 2 },
+	{ "pswpout", 3 }, { "compact_stall", 4 }, { "compact_fail", 5 },
+	{ "compact_success", 6 }, { "compact_migrate_scanned", 7 },
+	{ "compact_free_scanned", 8 }
+};
+
+struct trace_sample {
+	double t;
+	unsigned long long counts[trace_ncolumns];
+	double some_avg10, full_avg10;
+	unsigned long long some_us, full_us;	/* total stall times */
+};
+
+static void trace_sample(struct trace_sample *ts)
+{
+	char line[256], name[64], kind[8];
+	unsigned long long value;
+	double avg10;
+	FILE *fh;
+
+	memset(ts, 0, sizeof(*ts));
+	ts->t = elapsed_since(&trace_epoch);
+	fh = fopen("/proc/vmstat", "r");
+	if (fh != NULL) {
+		while (fgets(line, sizeof(line), fh) != NULL) {
+			if (sscanf(line, "%63s %llu", name, &value) != 2)
+				continue;
+			for (size_t i = 0; i < sizeof(trace_vmstat) / sizeof(trace_vmstat[0]); i++)
+				if (strcmp(name, trace_vmstat[i].name) == 0)
+					ts->counts[trace_vmstat[i].column] += value;
+		}
+		fclose(fh);
+	}
+	fh = fopen("/proc/pressure/memory", "r");
+	if (fh != NULL) {
+		while (fgets(line, sizeof(line), fh) != NULL) {
+			if (sscanf(line, "%7s avg10=%lf avg60=%*f avg300=%*f total=%llu",
+				   kind, &avg10, &value) != 3)
+				continue;
+			if (strcmp(kind, "some") == 0) {
+				ts->some_avg10 = avg10;
+				ts->some_us = value;
+			} else if (strcmp(kind, "full") == 0) {
+				ts->full_avg10 = avg10;
+				ts->full_us = value;
+			}
+		}
+		fclose(fh);
+	}
+}
+
+static void trace_row(struct trace_sample *prev, struct trace_sample *ts)
+{
+	int phase = __atomic_load_n(&progress_phase, __ATOMIC_RELAXED);
+
+	fprintf(trace_fh, "%.6f,%s,%zu,%zu,%zu", ts->t, phase_names[phase],
+		__atomic_load_n(&wastebin_memory_taken, __ATOMIC_RELAXED),
+		__atomic_load_n(&progress_done, __ATOMIC_RELAXED),
+		__atomic_load_n(&progress_total, __ATOMIC_RELAXED));
+	for (size_t i = 0; i < trace_ncolumns; i++)
+		fprintf(trace_fh, ",%llu", ts->counts[i] - prev->counts[i]);
+	fprintf(trace_fh, ",%.2f,%.2f,%llu,%llu\n", ts->some_avg10, ts->full_avg10,
+		ts->some_us - prev->some_us, ts->full_us - prev->full_us);
+}
+
+static void *trace_main(void *arg)
+{
+	struct trace_sample first, prev, ts;
+	struct timespec next;
+	unsigned seen = 0;
+	int active = 1;
+
+	(void)arg;
+	pthread_mutex_lock(&trace_lock);
+	while (1) {
+		while (seen == trace_starts && !trace_quit)
+			pthread_cond_wait(&trace_cond, &trace_lock);
+		if (seen == trace_starts)
+			break;
+		seen = trace_starts;
+		pthread_mutex_unlock(&trace_lock);
+
+		trace_sample(&first);
+		trace_row(&first, &first);
+		prev = first;
+		clock_gettime(CLOCK_MONOTONIC, &next);
+		for (active = 1; active; prev = ts) {
+			timespec_add_ns(&next, trace_interval_ms * 1000000L);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+			active = __atomic_load_n(&trace_active, __ATOMIC_ACQUIRE);
+			trace_sample(&ts);
+			trace_row(&prev, &ts);
+		}
+		fflush(trace_fh);
+		printf("%s: transition took %.3f s, pgscan %llu pgsteal %llu pswpin %llu "
+		       "pswpout %llu compact_stall %llu, memory stalls some %.1f full %.1f ms\n",
+		       trace_cmdstr, ts.t - first.t, ts.counts[0] - first.counts[0],
+		       ts.counts[1] - first.counts[1], ts.counts[2] - first.counts[2],
+		       ts.counts[3] - first.counts[3], ts.counts[4] - first.counts[4],
+		       (ts.some_us - first.some_us) / 1e3, (ts.full_us - first.full_us) / 1e3);
+		fflush(stdout);
+		pthread_mutex_lock(&trace_lock);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return NULL;
+}
+
+static void start_trace(char *cmdstr)
+{
+	if (trace_path == NULL)
+		return;
+	trace_fh = fopen(trace_path, "w");
+	if (trace_fh == NULL) {
+		fprintf(stderr, "%s: can't create trace %s\n", cmdstr, trace_path);
+		trace_path = NULL;
+		return;
+	}
+	fprintf(trace_fh, "time_s,phase,membytes,done,total");
+	for (size_t i = 0; i < trace_ncolumns; i++)
+		fprintf(trace_fh, ",%s", trace_columns[i]);
+	fprintf(trace_fh, ",psi_some_avg10,psi_full_avg10,psi_some_us,psi_full_us\n");
+	trace_cmdstr = cmdstr;
+	clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+	if (pthread_create(&trace_tid, NULL, trace_main, NULL) != 0) {
+		fprintf(stderr, "%s: can't start trace sampler\n", cmdstr);
+		fclose(trace_fh);
+		trace_path = NULL;
+	}
+}
+
+/* mark the start or end of an adjustment for the sampler */
+static void trace_adjusting(int active)
+{
+	if (trace_path == NULL)
+		return;
+	pthread_mutex_lock(&trace_lock);
+	__atomic_store_n(&trace_active, active, __ATOMIC_RELEASE);
+	trace_starts += active;
+	pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void stop_trace(void)
+{
+	if (trace_path == NULL)
+		return;
+	pthread_mutex_lock(&trace_lock);
+	trace_quit = 1;
+	pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_lock);
+	pthread_join(trace_tid, NULL);
+	fclose(trace_fh);
+}
+
+/*
+ * Requests arrive on the named pipe, and only the latest one matters. Whenever the
+ * daemon looks at the pipe it reads everything waiting there and keeps the last
+ * request as pending, so intermediate targets sent during a long adjustment are
+ * never applied. Memory growth also looks between chunks and stops early when a
+ * new request is pending, keeping what it has locked so far.
+ *
+ * Requests can also come over the control socket, /tmp/wastebin.sock, a seqpacket
+ * socket that carries one request or reply per packet. A WB_SET there is treated
+ * like one from the pipe, but the client is answered once that request has been
+ * applied, or once a later one has replaced it. WB_QUERY is answered at once with
+ * the current state, and WB_WAIT is answered when the request being applied is.
+ * Requests are numbered in the order they are accepted, so each waiting client
+ * is matched to the request it waits on. WB_HANDOVER asks for the memfd, see
+ * hand_over(), and WB_EXIT is a request for nothing after which the daemon exits
+ * even when persistent.
+ */
+#define control_socket_path "/tmp/wastebin.sock"
+#define max_clients 16
+static int wastebin_pipe = -1;
+static int wastebin_listen = -1;
+static int client_fds[max_clients] = { [0 ... max_clients - 1] = -1 };
+static struct wastebin_request client_req[max_clients];	/* what each client waits on */
+static unsigned long client_gen[max_clients];		/* 0 when not waiting */
+static struct wastebin_request pending;
+static int have_pending = 0;
+static unsigned long request_gen = 0, pending_gen, current_gen;
+static struct timespec pending_received, current_received;
+static int wastebin_idle = 0;		/* the current request has been applied */
+static int handover_client = -1;	/* client asking for the memfd */
+static int wastebin_persistent = 0;	/* -P option */
+static int exit_requested = 0;		/* by WB_EXIT, SIGTERM or SIGINT */
+static volatile sig_atomic_t wastebin_signalled = 0;
+static int signal_pipe[2] = { -1, -1 };	/* written by the handler, to wake up poll */
+
+static void close_client(int i)
+{
+	close(client_fds[i]);
+	client_fds[i] = -1;
+	client_gen[i] = 0;
+}
+
+static void send_status(int i, struct wastebin_request *req, int result,
+			struct timespec *received)
+{
+	struct wastebin_status st = {
+		req->op, req->id, result, current_req->membytes, current_req->cpus,
+		memory_wasted(),
+		wastebin_cpus_taken, wastebin_burners,
+		wastebin_burners ? current_req->burn_fraction : 0,
+		wastebin_mem_max, max_cpus_taken(),
+		received ? elapsed_since(received) : 0, llc_ways_taken, llc_ways,
+		bandwidth_taken };
+	if (result == WB_SUPERSEDED) {
+		st.target_membytes = req->membytes;
+		st.target_cpus = req->cpus;
+	}
+	if (send(client_fds[i], &st, sizeof(st), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(st))
+		close_client(i);
+}
+
+/* answer every client waiting on request number gen */
+static void reply_waiters(unsigned long gen, int result, struct timespec *received)
+{
+	for (int i = 0; i < max_clients; i++)
+		if (client_fds[i] >= 0 && client_gen[i] == gen) {
+			client_gen[i] = 0;
+			send_status(i, &client_req[i], result, received);
+		}
+}
+
+/* a target in absolute terms, from what could be wasted and the previous target */
+static long resolve_target(long value, int how, double pct, long max, long before)
+{
+	switch (how) {
+	case TARGET_PERCENT:
+		value = max * pct / 100;
+		break;
+	case TARGET_LEAVE:
+		value = max - value;
+		break;
+	case TARGET_RELATIVE:
+		value += before;
+		break;
+	}
+	return value < 0 ? 0 : value > max ? max : value;
+}
+
+/* turn the host dependent targets of req into sizes, relative to the target before */
+static void resolve_request(struct wastebin_request *req, struct wastebin_request *before,
+			    char *cmdstr)
+{
+	long max_cpus = max_cpus_taken();
+
+	if (req->mem_target != TARGET_ABSOLUTE) {
+		req->membytes = resolve_target(req->membytes, req->mem_target, req->mem_pct,
+					       wastebin_mem_max, before->membytes) & ~0xfffL;
+		req->mem_target = TARGET_ABSOLUTE;
+		printf("%s: memory target is %'ld bytes of %'ld\n", cmdstr, req->membytes,
+		       wastebin_mem_max);
+	}
+	if (req->cpus_target != TARGET_ABSOLUTE) {
+		req->cpus = resolve_target(req->cpus, req->cpus_target, req->cpus_pct, max_cpus,
+					   before->cpus);
+		req->cpus_target = TARGET_ABSOLUTE;
+		printf("%s: cpu target is %ld cpus of %ld\n", cmdstr, req->cpus, max_cpus);
+	}
+}
+
+/* make req the pending request, superseding any that wasn't started yet */
+static void queue_request(struct wastebin_request *req, char *cmdstr)
+{
+	resolve_request(req, have_pending ? &pending : current_req, cmdstr);
+	if (have_pending) {
+		printf("%s: skipping superseded request for %ld cpus and %'ld bytes\n",
+		       cmdstr, pending.cpus, pending.membytes);
+		reply_waiters(pending_gen, WB_SUPERSEDED, &pending_received);
+	}
+	pending = *req;
+	have_pending = 1;
+	pending_gen = ++request_gen;
+	clock_gettime(CLOCK_MONOTONIC, &pending_received);
+}
+
+/*
+ * Schedules (-S). A schedule ramps memory and cpus through a series of targets,
+ * each step coming due a fixed time after the daemon starts, so a capacity curve
+ * needs a single invocation and its timing doesn't depend on the caller. A
+ * schedule is made of clauses, separated by ';' or newlines, such as
+ *	mem 0..256G step 16G every 60s; cpus 0..8 step 1 every 120s
+ * and "@<file>" reads the clauses from a file. Each ramp starts at time 0 and
+ * ends on its last value, and a quantity without a ramp stays as given by <mem>
+ * or <ncpus>. A step that comes due is queued like a request, so it stops a lock
+ * in progress and supersedes an earlier step that was never reached. The time
+ * each step is reached is logged. A request from a client ends the schedule.
+ */
+struct schedule_step {
+	double at;		/* seconds after the schedule starts */
+	long membytes, cpus;
+};
+static struct schedule_step *schedule = NULL;
+static unsigned schedule_nsteps = 0;
+static unsigned schedule_next = 0;	/* next step to come due */
+static struct timespec schedule_start;
+static struct wastebin_request schedule_base;		/* what steps don't change */
+static int pending_step = -1, current_step = -1;	/* step of a request, or -1 */
+
+/* a duration such as 60, 60s, 500ms, 2m or 1h in seconds, or -1 if invalid */
+static double parse_duration(char *arg)
+{
+	char *endp;
+	double secs = strtod(arg, &endp);
+
+	if (endp == arg || secs < 0)
+		return -1;
+	if (strcmp(endp, "ms") == 0)
+		return secs / 1000;
+	if (strcmp(endp, "m") == 0)
+		return secs * 60;
+	if (strcmp(endp, "h") == 0)
+		return secs * 3600;
+	return *endp == '\0' || strcmp(endp, "s") == 0 ? secs : -1;
+}
+
+/* parse a ramp clause into its first and last values, step and period */
+static int parse_ramp(char *clause, int *is_mem, long *from, long *to, long *step,
+		      double *every)
+{
+	char kind[8], a[32], b[32], c[32], d[32];
+	int end = -1;
+
+	if (sscanf(clause, " %7s %31[^.]..%31s step %31s every %31s %n",
+		   kind, a, b, c, d, &end) != 5 || clause[end] != '\0')
+		return -1;
+	if (strcmp(kind, "mem") == 0) {
+		*is_mem = 1;
+		*from = strm2ul(a);
+		*to = strm2ul(b);
+		*step = strm2ul(c);
+	} else if (strcmp(kind, "cpus") == 0) {
+		*is_mem = 0;
+		*from = str2ul(a);
+		*to = str2ul(b);
+		*step = str2ul(c);
+	} else {
+		return -1;
+	}
+	*every = parse_duration(d);
+	return *from < 0 || *to < 0 || *step <= 0 || *every <= 0 ? -1 : 0;
+}
+
+/* value of a ramp at time t */
+static long ramp_value(long from, long to, long step, double every, double t)
+{
+	long k = t / every;
+	if (from <= to)
+		return k >= (to - from + step - 1) / step ? to : from + k * step;
+	return k >= (from - to + step - 1) / step ? to : from - k * step;
+}
+
+/* time of the last step of a ramp */
+static double ramp_length(long from, long to, long step, double every)
+{
+	long n = (from <= to ? to - from : from - to) + step - 1;
+	return n / step * every;
+}
+
+#define max_schedule_steps 100000
+
+/*
+ * parse a schedule over the targets in base, returns 0 or -1 with a message if
+ * the schedule is invalid
+ */
+static int parse_schedule(char *spec, struct wastebin_request *base, char *cmdstr)
+{
+	char text[8192], *clause, *save;
+	long from[2], to[2], step[2], a, b, c;
+	double every[2], end = 0, t, next;
+	int have[2] = { 0, 0 }, is_mem, r;
+	FILE *fh;
+	size_t nb;
+
+	if (spec[0] == '@') {
+		fh = fopen(spec + 1, "r");
+		if (fh == NULL) {
+			fprintf(stderr, "%s: can't read schedule %s\n", cmdstr, spec + 1);
+			return -1;
+		}
+		nb = fread(text, 1, sizeof(text) - 1, fh);
+		fclose(fh);
+		text[nb] = '\0';
+	} else if (snprintf(text, sizeof(text), "%s", spec) >= (int)sizeof(text)) {
+		return -1;
+	}
+	for (clause = strtok_r(text, ";\n", &save); clause != NULL;
+	     clause = strtok_r(NULL, ";\n", &save)) {
+		if (strspn(clause, " \t") == strlen(clause) || clause[strspn(clause, " \t")] == '#')
+			continue;
+		if (parse_ramp(clause, &is_mem, &a, &b, &c, &t) < 0 || have[!is_mem]) {
+			fprintf(stderr, "%s: bad schedule clause '%s'\n", cmdstr, clause);
+			return -1;
+		}
+		r = !is_mem;	/* ramp 0 is memory, 1 is cpus */
+		have[r] = 1;
+		from[r] = a; to[r] = b; step[r] = c; every[r] = t;
+		t = ramp_length(a, b, c, t);
+		if (t > end)
+			end = t;
+	}
+	if (!have[0] && !have[1])
+		return -1;
+
+	/* a step at every time either ramp changes, in order */
+	schedule_base = *base;
+	for (t = 0; ; t = next) {
+		struct schedule_step *at;
+		if (schedule_nsteps == max_schedule_steps) {
+			fprintf(stderr, "%s: schedule has more than %d steps\n", cmdstr,
+				max_schedule_steps);
+			return -1;
+		}
+		schedule = realloc(schedule, (schedule_nsteps + 1) * sizeof(*schedule));
+		if (schedule == NULL)
+			fail_exit("allocating schedule", cmdstr);
+		at = &schedule[schedule_nsteps++];
+		at->at = t;
+		at->membytes = have[0] ? ramp_value(from[0], to[0], step[0], every[0], t) :
+			base->membytes;
+		at->cpus = have[1] ? ramp_value(from[1], to[1], step[1], every[1], t) : base->cpus;
+		next = end + 1;
+		for (r = 0; r < 2; r++) {
+			/* the next multiple of the period, computed so it doesn't drift */
+			double n = (long)(t / every[r] + 1e-9) + 1;
+			if (have[r] && n * every[r] <= ramp_length(from[r], to[r], step[r], every[r]) &&
+			    n * every[r] < next)
+				next = n * every[r];
+		}
+		if (next > end)
+			break;
+	}
+	return 0;
+}
+
+/* the request for a step of the schedule */
+static void schedule_request(unsigned k, struct wastebin_request *req)
+{
+	*req = schedule_base;
+	req->op = WB_SET;
+	if (schedule[k].membytes != schedule_base.membytes) {
+		req->membytes = schedule[k].membytes;
+		req->mem_target = TARGET_ABSOLUTE;
+		req->per_node = 0;
+	}
+	if (schedule[k].cpus != schedule_base.cpus) {
+		req->cpus = schedule[k].cpus;
+		req->cpus_target = TARGET_ABSOLUTE;
+		req->cpulist[0] = '\0';
+	}
+}
+
+/* seconds until the next step comes due, negative if it is already due */
+static double schedule_wait(void)
+{
+	return schedule[schedule_next].at - elapsed_since(&schedule_start);
+}
+
+/* queue the last of the steps that have come due, returns 1 if any has */
+static int schedule_due(char *cmdstr)
+{
+	struct wastebin_request req;
+	int due = -1;
+
+	while (schedule_next < schedule_nsteps && schedule_wait() <= 0)
+		due = schedule_next++;
+	if (due < 0)
+		return 0;
+	printf("%s: schedule step %d of %u due at %.3f s, %ld cpus and %'ld bytes\n", cmdstr,
+	       due + 1, schedule_nsteps, schedule[due].at, schedule[due].cpus,
+	       schedule[due].membytes);
+	schedule_request(due, &req);
+	queue_request(&req, cmdstr);
+	pending_step = due;
+	return 1;
+}
+
+/* a poll timeout in ms, shortened to wake up when the next step comes due */
+static int schedule_timeout(int timeout)
+{
+	double wait;
+
+	if (schedule_next >= schedule_nsteps)
+		return timeout;
+	wait = schedule_wait() * 1000;
+	if (wait < 0)
+		return 0;
+	return wait < timeout ? (int)wait + 1 : timeout;
+}
+
+/* log when the current request's step was reached, or that it was not */
+static void log_step(int reached, char *cmdstr)
+{
+	struct timespec now;
+	struct tm tm;
+	char stamp[32];
+	double t;
+
+	if (current_step < 0)
+		return;
+	t = elapsed_since(&schedule_start);
+	if (!reached) {
+		printf("%s: schedule step %d of %u superseded before it was reached\n", cmdstr,
+		       current_step + 1, schedule_nsteps);
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	localtime_r(&now.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+	printf("%s: schedule step %d of %u reached at %s.%06ld, %.6f s into the schedule, "
+	       "%.3f s after it was due\n", cmdstr, current_step + 1, schedule_nsteps, stamp,
+	       now.tv_nsec / 1000, t, t - schedule[current_step].at);
+	if (current_step + 1 == (int)schedule_nsteps)
+		printf("%s: schedule finished\n", cmdstr);
+	fflush(stdout);
+}
+
+/* take in a request from client i, or from the pipe if i is -1 */
+static void accept_request(struct wastebin_request *req, int i, char *cmdstr)
+{
+	switch (req->op) {
+	case WB_QUERY:
+		send_status(i, req, WB_STATUS, NULL);
+		return;
+	case WB_WAIT:
+		client_req[i] = *req;
+		if (wastebin_idle)
+			send_status(i, req, WB_APPLIED, &current_received);
+		else
+			client_gen[i] = current_gen;
+		return;
+	case WB_HANDOVER:
+		if (i < 0 || wastebin_memfd < 0) {
+			fprintf(stderr, "%s: not backed by a memfd, can't hand over\n", cmdstr);
+			if (i >= 0)
+				close_client(i);
+			return;
+		}
+		if (req->huge != (int)wastebin_huge ||
+		    req->region_bytes != region_size(wastebin_huge)) {
+			fprintf(stderr, "%s: can't hand over to a daemon with another --huge or "
+				"memory size\n", cmdstr);
+			close_client(i);
+			return;
+		}
+		/* hand over at the top of the loop, keeping the target until then */
+		handover_client = i;
+		if (!have_pending) {
+			struct wastebin_request same = *current_req;
+			queue_request(&same, cmdstr);
+		}
+		return;
+	case WB_EXIT:
+		printf("%s: asked to exit\n", cmdstr);
+		*req = (struct wastebin_request){ .op = WB_EXIT, .id = req->id };
+		exit_requested = 1;
+		break;
+	}
+	if (schedule_next < schedule_nsteps) {
+		printf("%s: request ends the schedule after %u of %u steps\n", cmdstr,
+		       schedule_next, schedule_nsteps);
+		schedule_next = schedule_nsteps;
+	}
+	queue_request(req, cmdstr);
+	pending_step = -1;
+	if (i >= 0) {
+		client_req[i] = *req;
+		client_gen[i] = pending_gen;
+	}
+}
+
+/* read all waiting requests, keeping the latest in pending. returns have_pending */
+static int drain_requests(char *cmdstr)
+{
+	struct wastebin_request req;
+	char drained[16];
+	ssize_t nb;
+	int fd, i;
+
+	schedule_due(cmdstr);
+	while (signal_pipe[0] >= 0 && read(signal_pipe[0], drained, sizeof(drained)) > 0)
+		;
+	if (wastebin_signalled && !exit_requested) {
+		printf("%s: terminated by a signal\n", cmdstr);
+		req = (struct wastebin_request){ .op = WB_EXIT };
+		accept_request(&req, -1, cmdstr);
+	}
+	while ((nb = read(wastebin_pipe, &req, sizeof(req))) == sizeof(req)) {
+		req.op = WB_SET;
+		accept_request(&req, -1, cmdstr);
+	}
+	if (nb > 0 || (nb < 0 && errno != EAGAIN)) {
+		if (nb > 0)
+			fprintf(stderr, "%s: short read of %ld bytes from /tmp/wastebin\n",
+				cmdstr, (long)nb);
+		else
+			fprintf(stderr, "%s: reading /tmp/wastebin: %s\n", cmdstr, strerror(errno));
+		fail_exit("reading client command", cmdstr);
+	}
+	while (wastebin_listen >= 0 &&
+	       (fd = accept4(wastebin_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		for (i = 0; i < max_clients && client_fds[i] >= 0; i++)
+			;
+		if (i == max_clients) {
+			fprintf(stderr, "%s: too many control clients\n", cmdstr);
+			close(fd);
+		} else {
+			client_fds[i] = fd;
+			client_gen[i] = 0;
+		}
+	}
+	for (i = 0; i < max_clients; i++) {
+		if (client_fds[i] < 0)
+			continue;
+		while ((nb = recv(client_fds[i], &req, sizeof(req), 0)) == sizeof(req)) {
+			accept_request(&req, i, cmdstr);
+			if (client_fds[i] < 0)
+				break;
+		}
+		/* a hangup or a malformed packet ends the connection */
+		if (client_fds[i] >= 0 && (nb >= 0 || errno != EAGAIN))
+			close_client(i);
+	}
+	return have_pending;
+}
+
+/* wait up to timeout ms for a request to be readable, returns 1 if one may be */
+static int wait_for_request(int timeout, char *cmdstr)
+{
+	struct pollfd fds[max_clients + 3];
+	int nfds = 0, ec;
+
+	fds[nfds++] = (struct pollfd){ wastebin_pipe, POLLIN, 0 };
+	if (signal_pipe[0] >= 0)
+		fds[nfds++] = (struct pollfd){ signal_pipe[0], POLLIN, 0 };
+	if (wastebin_listen >= 0)
+		fds[nfds++] = (struct pollfd){ wastebin_listen, POLLIN, 0 };
+	for (int i = 0; i < max_clients; i++)
+		if (client_fds[i] >= 0)
+			fds[nfds++] = (struct pollfd){ client_fds[i], POLLIN, 0 };
+	ec = poll(fds, nfds, schedule_timeout(timeout));
+	if (ec < 0 && errno != EINTR)
+		fail_exit("polling named pipe", cmdstr);
+	return ec > 0 || (schedule_next < schedule_nsteps && schedule_wait() <= 0);
+}
+
+static int control_listen(char *cmdstr)
+{
+	struct sockaddr_un addr = { AF_UNIX, control_socket_path };
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	unlink(control_socket_path);	/* left behind by a daemon that died */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, max_clients) < 0) {
+		fprintf(stderr, "%s: can't listen on %s\n", cmdstr, control_socket_path);
+		close(fd);
+		return -1;
+	}
+	chmod(control_socket_path, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	return fd;
+}
+
+static int control_connect(void)
+{
+	struct sockaddr_un addr = { AF_UNIX, control_socket_path };
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/*
+ * send a request and wait for its reply, returns 0 or -1 if the daemon went away.
+ * Each request gets an id from the pid and a count, and a reply with another id,
+ * to an earlier request on the same connection, is passed over
+ */
+static int control_call(int fd, struct wastebin_request *req, struct wastebin_status *st)
+{
+	static unsigned count;
+
+	req->id = (unsigned)getpid() << 16 | (++count & 0xffff);
+	if (send(fd, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req))
+		return -1;
+	while (recv(fd, st, sizeof(*st), 0) == sizeof(*st))
+		if (st->id == req->id)
+			return 0;
+	return -1;
+}
+
+static void print_status(struct wastebin_status *st, char *cmdstr)
+{
+	printf("%s: target of %ld cpus and %'ld bytes %s after %.3f s\n", cmdstr,
+	       st->target_cpus, st->target_membytes, result_names[st->result], st->elapsed);
+	printf("%s: wasting %ld of %ld cpus and %'ld of %'ld bytes", cmdstr,
+	       st->cpus, st->max_cpus, st->membytes, st->max_membytes);
+	if (st->burners)
+		printf(", and %.2f of %d more cpus", st->burn_fraction, st->burners);
+	if (st->max_cache_ways)
+		printf(", %d of %d cache ways", st->cache_ways, st->max_cache_ways);
+	if (st->bandwidth_pct)
+		printf(", %d%% of memory bandwidth", st->bandwidth_pct);
+	printf("\n");
+	fflush(stdout);
+}
+
+/* exit status of a client: 0 if its target was reached */
+static int control_exit(int fd, struct wastebin_request *req, char *cmdstr)
+{
+	struct wastebin_status st;
+	if (control_call(fd, req, &st) < 0) {
+		/* the daemon quits once it holds nothing, without answering */
+		printf("%s: background process has exited\n", cmdstr);
+		return req->op == WB_QUERY ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	close(fd);
+	print_status(&st, cmdstr);
+	return st.result == WB_SUPERSEDED ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Persistent daemon (-P, -f). Normally the daemon exits once it holds nothing,
+ * and the next request pays for starting another one, with a fresh inventory
+ * and mapping of the region. With -P it stays at zero, ready to answer, until
+ * asked to exit with -x or sent SIGTERM or SIGINT, after which it gives back
+ * everything as for a request of zero and exits. With -f the invoking process
+ * is the daemon, logging to its own stdout and stderr, and it tells systemd it
+ * is ready through $NOTIFY_SOCKET, for a unit of Type=notify.
+ */
+static int wastebin_foreground = 0;	/* -f option */
+
+/*
+ * the flag alone could be set just after drain_requests looked at it and before
+ * poll is entered, leaving the signal unseen until the next request or timeout.
+ * A byte in signal_pipe makes that poll return at once
+ */
+static void terminate_handler(int sig)
+{
+	int saved = errno;
+	ssize_t nb;
+
+	(void)sig;
+	wastebin_signalled = 1;
+	nb = write(signal_pipe[1], "", 1);
+	(void)nb;
+	errno = saved;
+}
+
+static void catch_terminate(char *cmdstr)
+{
+	struct sigaction sa = { .sa_handler = terminate_handler, .sa_flags = SA_RESTART };
+
+	if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+		fail_exit("creating signal pipe", cmdstr);
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+}
+
+/* send READY=1 to systemd, if started by it */
+static void notify_ready(void)
+{
+	struct sockaddr_un addr = { AF_UNIX, "" };
+	char *path = getenv("NOTIFY_SOCKET");
+	socklen_t len;
+	int fd;
+
+	if (path == NULL || strlen(path) < 2 || strlen(path) >= sizeof(addr.sun_path) ||
+	    (path[0] != '/' && path[0] != '@'))
+		return;
+	strcpy(addr.sun_path, path);
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';	/* abstract namespace */
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+	sendto(fd, "READY=1", 7, MSG_NOSIGNAL, (struct sockaddr *)&addr, len);
+	close(fd);
+}
+
+/*
+ * Parallel locking: mlock() faults in and zeroes every page of the range from
+ * the calling thread, so one big mlock runs at the speed of a single core.
+ * Instead the range is cut into chunks that a pool of worker threads claim in
+ * address order and lock independently. Each worker is pinned to a different
+ * cpu that is still online, so the kernel spreads the zeroing across the
+ * machine. Workers stop claiming chunks once a new request is pending, and since
+ * every claimed chunk is finished, what was locked is still a prefix of the range.
+ * The memory taken and the progress are updated as chunks finish, and logged at
+ * most once a second. If the kernel refuses a chunk, what was locked before it
+ * is kept and whatever was locked after it is given back.
+ */
+static unsigned lock_threads = 1;	/* -j option */
+static size_t lock_chunk = 0;		/* -C option, 0 to size chunks by the range */
+#define lock_min_chunk (64L << 20)
+#define lock_max_chunk (1L << 30)
+
+/*
+ * Filling (-F). Pages are filled as each chunk is locked, by the worker that
+ * locked it, so the filling is spread over the lock threads. A pattern stays
+ * compressible but not zero, random content is neither compressible nor shared.
+ * The random words are a hash of their position, computed independently so the
+ * compiler can vectorize the loop, and cost two multiplies each.
+ */
+enum fill_mode { FILL_ZERO, FILL_PATTERN, FILL_RANDOM };
+static enum fill_mode wastebin_fill = FILL_ZERO;
+static uint64_t fill_pattern = 0x5a5a5a5a5a5a5a5aULL;
+static uint64_t fill_seed;
+
+static int parse_fill(char *arg)
+{
+	char *endp;
+
+	if (strcmp(arg, "zero") == 0) {
+		wastebin_fill = FILL_ZERO;
+	} else if (strcmp(arg, "random") == 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		fill_seed = now.tv_sec * 1000000000ULL + now.tv_nsec;
+		wastebin_fill = FILL_RANDOM;
+	} else if (strncmp(arg, "pattern", 7) == 0 && (arg[7] == '\0' || arg[7] == ':')) {
+		wastebin_fill = FILL_PATTERN;
+		if (arg[7] == ':') {
+			fill_pattern = strtoull(arg + 8, &endp, 16);
+			if (endp == arg + 8 || *endp != '\0')
+				return -1;
+		}
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/* fill len bytes at start, the pattern counted from the region it is part of */
+static void fill_range(char *region, char *start, size_t len)
+{
+	uint64_t *restrict w = (uint64_t *)start;
+	uint64_t first = (start - region) / sizeof(*w) + fill_seed;
+	size_t n = len / sizeof(*w);
+
+	if (wastebin_fill == FILL_PATTERN) {
+		for (size_t i = 0; i < n; i++)
+			w[i] = fill_pattern;
+	} else if (wastebin_fill == FILL_RANDOM) {
+		for (size_t i = 0; i < n; i++) {
+			uint64_t x = (first + i) * 0x9e3779b97f4a7c15ULL;
+			x ^= x >> 29;
+			x *= 0xbf58476d1ce4e5b9ULL;
+			w[i] = x ^ (x >> 32);
+		}
+	}
+}
+
+struct lock_job {
+	char *region;		/* start of the region the range is in */
+	char *base;		/* start of range being locked */
+	size_t len;		/* bytes in the range */
+	size_t chunk;		/* bytes a worker claims at a time */
+	size_t next;		/* offset of next unclaimed chunk, atomic */
+	int err;		/* errno of first failed mlock, or 0 */
+	int stop;		/* set when workers should claim no more chunks */
+	size_t done;		/* bytes locked so far, atomic */
+	unsigned finished;	/* workers that have returned, atomic */
+	char *cmdstr;
+	int main_thread;	/* set when the worker runs in the daemon's thread */
+	size_t failed_at;	/* offset of the lowest chunk that failed, atomic */
+	size_t taken;		/* wastebin_memory_taken before locking */
+	struct timespec start, logged;
+};
+
+/* from the daemon's thread, count what is locked so far and log it now and then */
+static void lock_progress(struct lock_job *job)
+{
+	size_t done = __atomic_load_n(&job->done, __ATOMIC_RELAXED);
+	double secs;
+
+	wastebin_memory_taken = job->taken + done;
+	publish_status(PHASE_LOCKING, done, job->len);
+	if (elapsed_since(&job->logged) < 1.0 || done == job->len)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &job->logged);
+	secs = elapsed_since(&job->start);
+	printf("%s: locked %'lu of %'lu bytes, %.2f GiB/s\n", job->cmdstr, done, job->len,
+	       done / (secs > 0 ? secs : 1e-9) / (1L << 30));
+	fflush(stdout);
+}
+
+static void *lock_worker(void *arg)
+{
+	struct lock_job *job = arg;
+	size_t off, n, failed;
+	int ok = 0;
+
+	while (!__atomic_load_n(&job->stop, __ATOMIC_RELAXED) &&
+	       (off = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED)) < job->len) {
+		n = job->len - off < job->chunk ? job->len - off : job->chunk;
+		if ((memfd_fallocate && fallocate(wastebin_memfd, 0, job->base + off - job->region,
+						  n) < 0) || mlock(job->base + off, n) < 0) {
+			__atomic_compare_exchange_n(&job->err, &ok, errno, 0,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			failed = __atomic_load_n(&job->failed_at, __ATOMIC_RELAXED);
+			while (off < failed &&
+			       !__atomic_compare_exchange_n(&job->failed_at, &failed, off, 0,
+							    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+			__atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		if (wastebin_fill != FILL_ZERO)
+			fill_range(job->region, job->base + off, n);
+		__atomic_fetch_add(&job->done, n, __ATOMIC_RELAXED);
+		/* only the daemon's own thread may read the pipe and publish */
+		if (job->main_thread) {
+			lock_progress(job);
+			if (drain_requests(job->cmdstr))
+				job->stop = 1;
+		}
+	}
+	__atomic_fetch_add(&job->finished, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * lock the range from its start, stopping early if a new request comes in.
+ * *locked is set to the bytes locked from the start, returns 0 or the errno
+ * of a failure, after which anything beyond *locked may be partly locked
+ */
+static int lock_range(char *base, size_t len, size_t *locked, char *cmdstr)
+{
+	pthread_t *tids;
+	pthread_attr_t attr;
+	struct lock_job job = { wastebin_memory, base, len, 0, 0, 0, 0, 0, 0, cmdstr, 0, len,
+				wastebin_memory_taken, { 0, 0 }, { 0, 0 } };
+	unsigned cpu = 0, started = 0, i;
+
+	job.chunk = len / (lock_threads * 4);
+	if (job.chunk < lock_min_chunk)
+		job.chunk = lock_min_chunk;
+	if (job.chunk > lock_max_chunk)
+		job.chunk = lock_max_chunk;
+	if (lock_chunk > 0)
+		job.chunk = lock_chunk;
+	job.chunk = round_to_page(job.chunk);	/* whole huge pages per chunk */
+	clock_gettime(CLOCK_MONOTONIC, &job.start);
+	job.logged = job.start;
+
+	tids = calloc(lock_threads, sizeof(*tids));
+	if (tids == NULL)
+		fail_exit("allocating lock threads", cmdstr);
+	for (started = 0; lock_threads > 1 && started < lock_threads; started++) {
+		pthread_attr_init(&attr);
+		/* round robin over the cpus that remain online */
+		cpu = next_id(cpus_online, nr_cpu_ids, cpu, 0);
+		if (cpu == nr_cpu_ids)
+			cpu = next_id(cpus_online, nr_cpu_ids, 0, 0);
+		if (cpu < nr_cpu_ids)
+			pin_thread_attr(&attr, cpu);
+		cpu++;
+		i = pthread_create(&tids[started], &attr, lock_worker, &job);
+		pthread_attr_destroy(&attr);
+		if (i != 0)
+			break;
+	}
+	if (started == 0) {	/* a single thread, do it ourselves */
+		job.main_thread = 1;
+		lock_worker(&job);
+	}
+	/* watch the pipe while the workers run */
+	while (__atomic_load_n(&job.finished, __ATOMIC_ACQUIRE) < started) {
+		if (wait_for_request(20, cmdstr) && drain_requests(cmdstr))
+			__atomic_store_n(&job.stop, 1, __ATOMIC_RELAXED);
+		lock_progress(&job);
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	*locked = job.next < len ? job.next : len;
+	if (job.failed_at < *locked)
+		*locked = job.failed_at;
+	wastebin_memory_taken = job.taken;	/* the caller counts what was kept */
+	return job.err;
+}
+
+static void lock_fail_exit(int err, char *cmdstr)
+{
+	switch (err) {
+	case EPERM:
+		fail_exit("Lock memory requires CAP_IPC_LOCK", cmdstr);
+	default:
+		fail_exit("Can't lock the pages in memory\n", cmdstr);
+	}
+}
+
+/*
+ * Releasing (-R, -A). Memory is given back from the top of each slice, a chunk
+ * at a time, looking for new requests in between. Unlocked pages are discarded
+ * with MADV_DONTNEED (the default), MADV_FREE, which leaves them for reclaim to
+ * free lazily and so costs little now, or MADV_REMOVE, for which the region is
+ * made a shared mapping, so its shmem pages are freed at once. With -A the
+ * daemon only unlocks each chunk, after which it counts as released, and a
+ * release thread discards it, so cpus and other requests go on meanwhile. The
+ * release queue is drained before memory is taken again.
+ */
+struct release_range {
+	char *start;
+	size_t len;
+	int node;
+};
+static struct release_range *release_queue = NULL;
+static unsigned release_queued = 0, release_room = 0;
+static int release_busy = 0;		/* the release thread is discarding a range */
+static pthread_mutex_t release_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t release_cond = PTHREAD_COND_INITIALIZER;
+
+static int parse_release(char *arg)
+{
+	for (unsigned i = 0; i < sizeof(release_names) / sizeof(release_names[0]); i++)
+		if (strcmp(arg, release_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * Discarding works on THP and, since Linux 5.18, on hugetlb mappings. Older
+ * kernels refuse MADV_DONTNEED on hugetlb, so there the range is replaced by a
+ * fresh mapping instead. MADV_FREE only works on private anonymous memory, and
+ * falls back to MADV_DONTNEED elsewhere. A memfd has its pages punched out.
+ */
+static void discard_range(char *start, size_t len, int node, char *cmdstr)
+{
+	if (wastebin_memfd >= 0) {
+		if (fallocate(wastebin_memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      start - wastebin_memory, len) < 0)
+			fprintf(stderr, "%s: could not punch %'lu bytes out of the memfd: %s\n",
+				cmdstr, len, strerror(errno));
+		return;
+	}
+	if (wastebin_release == RELEASE_FREE && madvise(start, len, MADV_FREE) == 0)
+		return;
+	if (wastebin_release == RELEASE_REMOVE && madvise(start, len, MADV_REMOVE) == 0)
+		return;
+	if (madvise(start, len, MADV_DONTNEED) == 0 || !(wastebin_map_flags & MAP_HUGETLB))
+		return;
+	if (mmap(start, len, PROT_READ | PROT_WRITE, wastebin_map_flags | MAP_FIXED,
+		 -1, 0) == MAP_FAILED)
+		fprintf(stderr, "%s: could not release %'lu hugetlb bytes\n", cmdstr, len);
+	else
+		bind_range(start, len, node, cmdstr); /* new mapping has no policy */
+}
+
+static void *release_thread(void *arg)
+{
+	char *cmdstr = arg;
+	struct release_range r;
+
+	pthread_mutex_lock(&release_lock);
+	while (1) {
+		while (release_queued == 0)
+			pthread_cond_wait(&release_cond, &release_lock);
+		r = release_queue[--release_queued];
+		release_busy = 1;
+		pthread_mutex_unlock(&release_lock);
+		discard_range(r.start, r.len, r.node, cmdstr);
+		pthread_mutex_lock(&release_lock);
+		release_busy = 0;
+		pthread_cond_broadcast(&release_cond);
+	}
+	return NULL;
+}
+
+static void start_release_thread(char *cmdstr)
+{
+	pthread_t tid;
+
+	if (wastebin_release != RELEASE_DONTNEED && wastebin_memfd >= 0)
+		fprintf(stderr, "%s: the region is a memfd, --release is ignored\n", cmdstr);
+	if (!release_async)
+		return;
+	if (pthread_create(&tid, NULL, release_thread, cmdstr) != 0)
+		fail_exit("starting release thread", cmdstr);
+	pthread_detach(tid);
+}
+
+/* wait until the release thread has discarded everything queued */
+static void wait_release(void)
+{
+	pthread_mutex_lock(&release_lock);
+	while (release_queued > 0 || release_busy)
+		pthread_cond_wait(&release_cond, &release_lock);
+	pthread_mutex_unlock(&release_lock);
+}
+
+/* give back pages at the end of the region */
+static void release_memory(char *start, size_t len, int node, char *cmdstr)
+{
+	munlock(start, len);
+	if (!release_async) {
+		discard_range(start, len, node, cmdstr);
+		return;
+	}
+	pthread_mutex_lock(&release_lock);
+	if (release_queued == release_room) {
+		release_room = release_room ? 2 * release_room : 16;
+		release_queue = realloc(release_queue, release_room * sizeof(*release_queue));
+		if (release_queue == NULL)
+			fail_exit("allocating release queue", cmdstr);
+	}
+	release_queue[release_queued++] = (struct release_range){ start, len, node };
+	pthread_cond_broadcast(&release_cond);
+	pthread_mutex_unlock(&release_lock);
+}
+
+static void adjust_slice(struct waste_slice *slice, size_t membytes, char *cmdstr)
+{
+	if (membytes > slice->size) {
+		fprintf(stderr, "%s: can't waste %'lu bytes, limited to %'lu\n",
+			cmdstr, membytes, slice->size);
+		membytes = slice->size;
+	}
+	if (slice->taken < membytes) {
+		struct timespec start;
+		double secs;
+		size_t locked;
+		int err = 0;
+		wait_release();	/* the range may still be queued for discarding */
+		fprintf(stderr, "%s: mlock called to lock %'lu bytes\n",
+			cmdstr, membytes - slice->taken);
+		if (slice->node >= 0)
+			fprintf(stderr, "%s: on node %d\n", cmdstr, slice->node);
+		fflush(stderr);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		publish_status(PHASE_LOCKING, 0, membytes - slice->taken);
+		/* mlock sets all pages to zeros */
+		err = lock_range(slice->base + slice->taken, membytes - slice->taken,
+				 &locked, cmdstr);
+		secs = elapsed_since(&start);
+		fprintf(stderr, "%s: has locked %'lu bytes in %.3f s, %.2f GiB/s\n",
+			cmdstr, locked, secs, locked / (secs > 0 ? secs : 1e-9) / (1L << 30));
+		fflush(stderr);
+		if (err != 0 && wastebin_memory_taken == 0 && locked == 0)
+			lock_fail_exit(err, cmdstr);
+		if (err != 0) {
+			/* keep what was locked, give back chunks past the failure */
+			fprintf(stderr, "%s: could not lock more: %s, keeping %'lu bytes\n",
+				cmdstr, strerror(err), locked);
+			release_memory(slice->base + slice->taken + locked,
+				       membytes - slice->taken - locked, slice->node, cmdstr);
+		} else if (locked < membytes - slice->taken) {
+			printf("%s: new request, stopped %'lu bytes short\n", cmdstr,
+			       membytes - slice->taken - locked);
+		}
+		verify_range(slice->base + slice->taken, locked, 1, cmdstr);
+		wastebin_memory_taken += locked;
+		slice->taken += locked;
+		log_event(EV_LOCK, locked, secs, cmdstr);
+	} else if (slice->taken > membytes) {
+		size_t chunk = lock_chunk > 0 ? round_to_page(lock_chunk) : lock_max_chunk;
+		size_t total = slice->taken - membytes, done = 0, n;
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		publish_status(PHASE_RELEASING, 0, total);
+		while (slice->taken > membytes) {
+			n = slice->taken - membytes < chunk ? slice->taken - membytes : chunk;
+			release_memory(slice->base + slice->taken - n, n, slice->node, cmdstr);
+			/* lazily freed or queued pages may still be resident */
+			if (!release_async && wastebin_release != RELEASE_FREE)
+				verify_range(slice->base + slice->taken - n, n, 0, cmdstr);
+			wastebin_memory_taken -= n;
+			slice->taken -= n;
+			done += n;
+			publish_status(PHASE_RELEASING, done, total);
+			if (slice->taken > membytes && drain_requests(cmdstr)) {
+				printf("%s: new request, stopped releasing %'lu bytes short\n",
+				       cmdstr, slice->taken - membytes);
+				break;
+			}
+		}
+		log_event(EV_RELEASE, done, elapsed_since(&start), cmdstr);
+	}
+}
+
+/* returns 1 if the target was reached, 0 if stopped early by a new request */
+static int adjust_memory(struct wastebin_request *req, char *cmdstr)
+{
+	size_t targets[max_node_count];
+	size_t total = round_to_page(req->membytes);
+	unsigned __int128 cum = 0;
+	size_t done = 0, upto;
+	unsigned i;
+
+	if (req->per_node && !wastebin_numa)
+		fprintf(stderr, "%s: not started with --numa, wasting %'lu bytes on any node\n",
+			cmdstr, total);
+	else if (req->per_node)
+		for (int node = 0; node < max_node_count; node++) {
+			for (i = 0; i < wastebin_nslices && wastebin_slices[i].node != node; i++)
+				;
+			if (req->node_membytes[node] > 0 && i == wastebin_nslices)
+				fprintf(stderr, "%s: node %d has no slice, can't waste %'ld bytes "
+					"on it\n", cmdstr, node, req->node_membytes[node]);
+		}
+	for (i = 0; i < wastebin_nslices; i++) {
+		struct waste_slice *slice = &wastebin_slices[i];
+		if (req->per_node && slice->node >= 0) {
+			targets[i] = round_to_page(req->node_membytes[slice->node]);
+			continue;
+		}
+		/* balance by node size, rounding cumulative sums so they add up */
+		cum += slice->size;
+		upto = i + 1 == wastebin_nslices ? total :
+			round_to_page(total * cum / wastebin_max_size);
+		targets[i] = upto - done;
+		done = upto;
+	}
+	/* free memory before taking more */
+	for (i = 0; i < wastebin_nslices; i++)
+		if (wastebin_slices[i].taken > targets[i])
+			adjust_slice(&wastebin_slices[i], targets[i], cmdstr);
+	for (i = 0; i < wastebin_nslices && !have_pending; i++)
+		if (wastebin_slices[i].taken < targets[i])
+			adjust_slice(&wastebin_slices[i], targets[i], cmdstr);
+        show_incore_memory(cmdstr);
+	if (req->audit)
+		audit_incore_memory(cmdstr);
+	for (i = 0; i < wastebin_nslices; i++)
+		if ((wastebin_slices[i].taken < targets[i] &&
+		     wastebin_slices[i].taken < wastebin_slices[i].size) ||
+		    wastebin_slices[i].taken > targets[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * Memory block backend (-m offline). Locked pages still count in MemTotal and in
+ * their zones, so the kernel keeps sizing watermarks, LRUs and per zone structures
+ * for the whole machine. Taking memory blocks offline through
+ * /sys/devices/system/memory removes them from the zones, as if the memory had
+ * never been installed. Blocks in ZONE_MOVABLE go first, since their pages can
+ * always be migrated away, then the others, highest first. A block that fails
+ * to go offline (it holds unmovable pages) is not tried again. Whatever can't be
+ * taken in whole blocks is locked as before. Blocks come back online in the
+ * reverse of the order they went offline. Per node requests are only locked.
+ *
+ * cgroup backend (-m cgroup:<cgroup>). For sizing containers, memory is taken
+ * from one cgroup v2 subtree only, by lowering its memory.max (or memory.high,
+ * with cgroup-high:<cgroup>, which throttles and reclaims rather than OOM kills)
+ * from its limit at start, or from the host's memory if it had none, by the
+ * target. Nothing is locked, the kernel reclaims from that cgroup alone, and a
+ * change takes as long as that reclaim. The limit is put back once the target
+ * is 0, and so when the daemon exits. Percentages, leave: and the maximum in the
+ * status are then out of that limit at start rather than the host's memory.
+ */
+enum mem_backend { MEM_MLOCK, MEM_OFFLINE, MEM_CGROUP };
+static const char *mem_backend_names[] = { "mlock", "offline" };
+static enum mem_backend wastebin_mem_backend = MEM_MLOCK;
+static char *memcg_target;		/* cgroup to limit */
+static char *memcg_file;		/* memory.max or memory.high */
+static char memcg_saved[64];		/* its value before any memory was taken */
+static long memcg_baseline;		/* the limit taken from, in bytes */
+struct mem_block {
+	unsigned id;		/* N of /sys/devices/system/memory/memoryN */
+	int movable;		/* in ZONE_MOVABLE */
+	int offline;		/* taken offline by us */
+	int failed;		/* couldn't be taken offline */
+};
+static struct mem_block *mem_blocks = NULL;
+static unsigned mem_nblocks = 0;
+static unsigned *blocks_offline;	/* indexes of blocks in the order taken */
+static unsigned mem_noffline = 0;
+static size_t mem_block_size = 0;
+
+static int parse_mem_backend(char *arg)
+{
+	if (strncmp(arg, "cgroup:", 7) == 0 || strncmp(arg, "cgroup-high:", 12) == 0) {
+		memcg_file = arg[6] == ':' ? "memory.max" : "memory.high";
+		memcg_target = strchr(arg, ':') + 1;
+		return *memcg_target != '\0' ? MEM_CGROUP : -1;
+	}
+	for (unsigned i = 0; i < sizeof(mem_backend_names) / sizeof(mem_backend_names[0]); i++)
+		if (strcmp(arg, mem_backend_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+/* movable blocks first, then highest numbered first */
+static int compare_blocks(const void *a, const void *b)
+{
+	const struct mem_block *x = a, *y = b;
+	if (x->movable != y->movable)
+		return y->movable - x->movable;
+	return x->id < y->id ? 1 : x->id > y->id ? -1 : 0;
+}
+
+static void inventory_mem_blocks(char *cmdstr)
+{
+	char path[PATH_MAX], buf[64];
+	struct dirent *de;
+	unsigned id, movable = 0;
+	DIR *dir;
+
+	if (wastebin_mem_backend != MEM_OFFLINE)
+		return;
+	if (read_file("/sys/devices/system/memory/block_size_bytes", buf, sizeof(buf)) == 0)
+		mem_block_size = strtoul(buf, NULL, 16);
+	dir = opendir("/sys/devices/system/memory");
+	if (mem_block_size == 0 || dir == NULL) {
+		fprintf(stderr, "%s: no memory blocks, only locking memory\n", cmdstr);
+		wastebin_mem_backend = MEM_MLOCK;
+		if (dir != NULL)
+			closedir(dir);
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (sscanf(de->d_name, "memory%u", &id) != 1)
+			continue;
+		/* only blocks that are online and could go offline */
+		snprintf(path, sizeof(path), "/sys/devices/system/memory/memory%u/state", id);
+		if (read_file(path, buf, sizeof(buf)) < 0 || strcmp(buf, "online") != 0)
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/memory/memory%u/valid_zones", id);
+		if (read_file(path, buf, sizeof(buf)) < 0 || strcmp(buf, "none") == 0)
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/memory/memory%u/online", id);
+		if (access(path, W_OK) != 0)
+			continue;
+		mem_blocks = realloc(mem_blocks, (mem_nblocks + 1) * sizeof(*mem_blocks));
+		if (mem_blocks == NULL)
+			fail_exit("allocating memory blocks", cmdstr);
+		/* an online block's zone is the first one listed */
+		mem_blocks[mem_nblocks++] = (struct mem_block){ id, strncmp(buf, "Movable", 7) == 0,
+								 0, 0 };
+		movable += mem_blocks[mem_nblocks - 1].movable;
+	}
+	closedir(dir);
+	qsort(mem_blocks, mem_nblocks, sizeof(*mem_blocks), compare_blocks);
+	blocks_offline = calloc(mem_nblocks + 1, sizeof(*blocks_offline));
+	if (blocks_offline == NULL)
+		fail_exit("allocating memory blocks", cmdstr);
+	printf("%s: %u memory blocks of %'lu bytes could go offline, %u of them movable\n",
+	       cmdstr, mem_nblocks, mem_block_size, movable);
+}
+
+static int set_block_online(unsigned id, int online)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/sys/devices/system/memory/memory%u/online", id);
+	return write_file(path, online ? "1" : "0");
+}
+
+static void inventory_memcg(char *cmdstr)
+{
+	char path[PATH_MAX];
+
+	wastebin_mem_max = wastebin_max_size;
+	if (wastebin_mem_backend != MEM_CGROUP)
+		return;
+	snprintf(path, sizeof(path), "%s/%s", memcg_target, memcg_file);
+	if (read_file(path, memcg_saved, sizeof(memcg_saved)) < 0)
+		fail_exit("reading the memory limit of the target cgroup", cmdstr);
+	memcg_baseline = strcmp(memcg_saved, "max") == 0 ? wastebin_max_size :
+		strtol(memcg_saved, NULL, 10);
+	printf("%s: limiting memory of %s with %s, now %s, taking from %'ld bytes\n", cmdstr,
+	       memcg_target, memcg_file, memcg_saved, memcg_baseline);
+	wastebin_mem_max = memcg_baseline;
+}
+
+/* lower the cgroup's limit by the target, returns 1 if the target was reached */
+static int adjust_memcg(struct wastebin_request *req, char *cmdstr)
+{
+	long want = req->membytes < memcg_baseline ? req->membytes : memcg_baseline;
+	char path[PATH_MAX], value[64];
+	struct timespec start;
+	double secs;
+
+	if (req->membytes > memcg_baseline)
+		fprintf(stderr, "%s: can't take %'ld bytes from %s, limited to %'ld\n", cmdstr,
+			req->membytes, memcg_target, memcg_baseline);
+	if ((size_t)want == wastebin_memory_limited)
+		return 1;
+	if (want == 0)
+		snprintf(value, sizeof(value), "%s", memcg_saved);
+	else
+		snprintf(value, sizeof(value), "%ld", memcg_baseline - want);
+	snprintf(path, sizeof(path), "%s/%s", memcg_target, memcg_file);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	publish_status(PHASE_LOCKING, 0, want);
+	/* the write returns once the cgroup has been reclaimed down to the limit */
+	if (write_file(path, value) < 0) {
+		fprintf(stderr, "%s: writing '%s' to %s: %s\n", cmdstr, value, path,
+			strerror(errno));
+		return 0;
+	}
+	secs = elapsed_since(&start);
+	wastebin_memory_limited = want;
+	log_event(EV_LIMIT, memcg_baseline - want, secs, cmdstr);
+	printf("%s: %s of %s set to %s in %.3f ms, %'ld bytes in use\n", cmdstr, memcg_file,
+	       memcg_target, value, secs * 1e3,
+	       read_sysfs_long("%s/memory.current", memcg_target));
+	fflush(stdout);
+	return 1;
+}
+
+/*
+ * reach the memory target in req with memory blocks and locked memory, or with
+ * locked memory only. returns 1 if the target was reached
+ */
+static int adjust_offline(struct wastebin_request *req, char *cmdstr)
+{
+	struct wastebin_request lockreq = *req;
+	size_t want, before = wastebin_memory_offline;
+	struct timespec start;
+	unsigned i, failed = 0;
+	int stopped = 0;
+	long membytes;
+
+	if (wastebin_mem_backend == MEM_CGROUP)
+		return adjust_memcg(req, cmdstr);
+	if (req->per_node)
+		return adjust_memory(req, cmdstr);
+	/* the streamers' buffers already take part of the target */
+	membytes = req->membytes > (long)wastebin_memory_streaming ?
+		req->membytes - (long)wastebin_memory_streaming : 0;
+	lockreq.membytes = membytes;
+	if (wastebin_mem_backend != MEM_OFFLINE)
+		return adjust_memory(&lockreq, cmdstr);
+	want = membytes / mem_block_size * mem_block_size;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* bring blocks back first, the rest may need their memory */
+	while (wastebin_memory_offline > want) {
+		struct mem_block *b = &mem_blocks[blocks_offline[--mem_noffline]];
+		if (set_block_online(b->id, 1) < 0)
+			fail_exit("bringing memory block back online", cmdstr);
+		b->offline = 0;
+		wastebin_memory_offline -= mem_block_size;
+	}
+	if (wastebin_memory_offline < want) {
+		/* unlock what the blocks will cover, so its memory can go offline */
+		if ((size_t)wastebin_memory_taken > membytes - want) {
+			lockreq.membytes = membytes - want;
+			adjust_memory(&lockreq, cmdstr);
+			wait_release();
+		}
+		for (i = 0; i < mem_nblocks && wastebin_memory_offline < want; i++) {
+			struct mem_block *b = &mem_blocks[i];
+			if (drain_requests(cmdstr)) {
+				stopped = 1;
+				break;
+			}
+			if (b->offline || b->failed)
+				continue;
+			if (set_block_online(b->id, 0) < 0) {
+				b->failed = 1;
+				failed++;
+				continue;
+			}
+			b->offline = 1;
+			blocks_offline[mem_noffline++] = i;
+			wastebin_memory_offline += mem_block_size;
+		}
+	}
+	if (wastebin_memory_offline != before)
+		log_event(EV_BLOCKS, wastebin_memory_offline, elapsed_since(&start), cmdstr);
+	if (wastebin_memory_offline != before || failed > 0)
+		printf("%s: %'lu bytes in %u memory blocks offline after %.3f s, %u blocks "
+		       "couldn't go offline\n", cmdstr, wastebin_memory_offline, mem_noffline,
+		       elapsed_since(&start), failed);
+	lockreq.membytes = membytes - wastebin_memory_offline;
+	return adjust_memory(&lockreq, cmdstr) && !stopped;
+}
+
+/*
+ * Handover (-X). A daemon started with -X asks the running one for its memfd
+ * over the control socket. The old daemon finishes what it was doing, sends the
+ * fd with SCM_RIGHTS along with how much of each slice it holds, forgets that
+ * memory by unlocking it without discarding it, gives back everything else and
+ * exits. The new daemon then maps the same file and locks the pages that are
+ * already there, so restarting costs no zeroing or reclaim. Until it does, the
+ * pages are only unlocked, which matters only with swap, and hugetlb pages
+ * never swap. Both must be started with the same --huge and --numa. The request
+ * carries the new daemon's --huge mode and region size, and the old one refuses
+ * a mismatch before giving up anything, as it does if the fd can't be sent.
+ */
+struct wastebin_handover {
+	int huge;		/* the --huge mode of the region */
+	unsigned nslices;
+	size_t taken[max_node_count];
+};
+static struct wastebin_handover handover;	/* what was handed to us */
+static int wastebin_takeover = 0;		/* -X option */
+
+/* in the old daemon, send the memfd and forget the memory in it. returns 1 if sent */
+static int hand_over(char *cmdstr)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct wastebin_handover h = { wastebin_huge, wastebin_nslices, { 0 } };
+	struct iovec iov = { &h, sizeof(h) };
+	struct msghdr msg = { NULL, 0, &iov, 1, cbuf, sizeof(cbuf), 0 };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	int i = handover_client;
+
+	handover_client = -1;
+	wait_release();
+	for (unsigned s = 0; s < wastebin_nslices; s++)
+		h.taken[s] = wastebin_slices[s].taken;
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &wastebin_memfd, sizeof(int));
+	if (client_fds[i] < 0 || sendmsg(client_fds[i], &msg, MSG_NOSIGNAL) != sizeof(h)) {
+		fprintf(stderr, "%s: could not hand over the memfd, keeping it\n", cmdstr);
+		if (client_fds[i] >= 0)
+			close_client(i);
+		return 0;
+	}
+	printf("%s: handed over %'ld bytes in the memfd\n", cmdstr, wastebin_memory_taken);
+	fflush(stdout);
+	/* unlocking leaves the pages in the file */
+	for (unsigned s = 0; s < wastebin_nslices; s++) {
+		munlock(wastebin_slices[s].base, wastebin_slices[s].taken);
+		wastebin_slices[s].taken = 0;
+	}
+	wastebin_memory_taken = 0;
+	return 1;
+}
+
+/* before starting a daemon, take the memfd of the running one */
+static void take_over(char *cmdstr)
+{
+	struct wastebin_request req = { .op = WB_HANDOVER, .huge = wastebin_huge,
+					.region_bytes = region_size(wastebin_huge) };
+	char cbuf[CMSG_SPACE(sizeof(int))], c;
+	struct iovec iov = { &handover, sizeof(handover) };
+	struct msghdr msg = { NULL, 0, &iov, 1, cbuf, sizeof(cbuf), 0 };
+	struct cmsghdr *cmsg;
+	int fd = control_connect();
+
+	if (fd < 0) {
+		printf("%s: no background process to take over from\n", cmdstr);
+		return;
+	}
+	if (send(fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req) ||
+	    recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(handover) ||
+	    (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+		fail_exit("the background process did not hand over a memfd, see its log", cmdstr);
+	memcpy(&wastebin_memfd, CMSG_DATA(cmsg), sizeof(int));
+	wastebin_use_memfd = 1;
+	if (handover.huge != (int)wastebin_huge)
+		fail_exit("taking over needs the same --huge as the background process", cmdstr);
+	/* the old daemon closes the connection as it exits */
+	while (recv(fd, &c, 1, 0) > 0)
+		;
+	close(fd);
+	for (int tries = 0; tries < 1000 && access("/tmp/wastebin", F_OK) == 0; tries++)
+		usleep(10000);
+	printf("%s: took over the memfd of the background process\n", cmdstr);
+	fflush(stdout);
+}
+
+/* in the new daemon, lock what the old one held */
+static void adopt_handover(char *cmdstr)
+{
+	size_t total = 0;
+
+	if (handover.nslices == 0)
+		return;
+	if (handover.nslices != wastebin_nslices) {
+		/* the nodes differ, start over with an empty file */
+		fprintf(stderr, "%s: handed over %u slices for %u, discarding them\n", cmdstr,
+			handover.nslices, wastebin_nslices);
+		fallocate(wastebin_memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+			  wastebin_max_size);
+		return;
+	}
+	for (unsigned s = 0; s < wastebin_nslices; s++) {
+		struct waste_slice *slice = &wastebin_slices[s];
+		size_t taken = handover.taken[s] < slice->size ? handover.taken[s] : slice->size;
+		if (taken > 0 && mlock(slice->base, taken) < 0)
+			lock_fail_exit(errno, cmdstr);
+		slice->taken = taken;
+		total += taken;
+	}
+	wastebin_memory_taken = total;
+	printf("%s: took over %'lu bytes locked by the previous background process\n",
+	       cmdstr, total);
+}
+
+/*
+ * Setpoints. Instead of a size, <mem> may be avail:<size> to hold MemAvailable at
+ * <size>, or psi:<pct> to hold the memory pressure's some avg10 at or under <pct>,
+ * while the workload's footprint changes. Every setpoint_period_ms the daemon's
+ * wait for requests times out, it samples /proc and moves the memory target,
+ * which adjust_memory then reaches as for any request. MemAvailable is steered
+ * by half its error at each step, ignoring errors within setpoint_deadband.
+ * Pressure is a lagging average, so over the setpoint a quarter of what is
+ * taken is given back, and growth waits until the average has had time to
+ * settle and then creeps up while under half the setpoint. Each step is limited
+ * to setpoint_max_grow bytes more or setpoint_max_shrink less. With the cgroup
+ * backend, the host's figures say little about the cgroup, so what is available
+ * is the room left under its lowered limit, from its memory.current, and the
+ * pressure is its memory.pressure.
+ */
+#define setpoint_period_ms 1000
+#define setpoint_deadband (32L << 20)
+#define setpoint_max_grow (1L << 30)
+#define setpoint_max_shrink (4L << 30)
+#define setpoint_psi_step (64L << 20)
+#define setpoint_psi_settle 10.0	/* seconds covered by avg10 */
+static struct timespec setpoint_tick;		/* last time the target moved */
+static struct timespec setpoint_backoff;	/* last time pressure pushed back */
+
+static long meminfo_bytes(char *field)
+{
+	char line[128];
+	size_t len = strlen(field);
+	FILE *fh;
+	long kb = -1;
+
+	fh = fopen("/proc/meminfo", "r");
+	if (fh == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fh) != NULL)
+		if (strncmp(line, field, len) == 0 && line[len] == ':') {
+			sscanf(line + len + 1, "%ld", &kb);
+			break;
+		}
+	fclose(fh);
+	return kb < 0 ? -1 : kb << 10;
+}
+
+/* what the workload could still use, or -1 if unknown */
+static long memory_available(void)
+{
+	char path[PATH_MAX], value[64];
+
+	if (wastebin_mem_backend != MEM_CGROUP)
+		return meminfo_bytes("MemAvailable");
+	snprintf(path, sizeof(path), "%s/memory.current", memcg_target);
+	if (read_file(path, value, sizeof(value)) < 0)
+		return -1;
+	return memcg_baseline - (long)wastebin_memory_limited - strtol(value, NULL, 10);
+}
+
+/* some avg10 of memory pressure, in percent, or -1 without PSI */
+static double memory_pressure(void)
+{
+	char line[128], path[PATH_MAX] = "/proc/pressure/memory";
+	double avg10 = -1;
+	FILE *fh;
+
+	if (wastebin_mem_backend == MEM_CGROUP)
+		snprintf(path, sizeof(path), "%s/memory.pressure", memcg_target);
+	fh = fopen(path, "r");
+	if (fh == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fh) != NULL)
+		if (sscanf(line, "some avg10=%lf", &avg10) == 1)
+			break;
+	fclose(fh);
+	return avg10;
+}
+
+/* begin steering from what is taken now, as a new request is taken up */
+static void start_setpoint(struct wastebin_request *req)
+{
+	if (req->setpoint == SETPOINT_NONE)
+		return;
+	req->membytes = memory_wasted();
+	clock_gettime(CLOCK_MONOTONIC, &setpoint_tick);
+	setpoint_backoff = (struct timespec){ 0, 0 };
+}
+
+/* a poll timeout in ms, shortened to wake up for the next setpoint sample */
+static int setpoint_timeout(struct wastebin_request *req, int timeout)
+{
+	double wait;
+
+	if (req->setpoint == SETPOINT_NONE)
+		return timeout;
+	wait = setpoint_period_ms - elapsed_since(&setpoint_tick) * 1000;
+	if (wait < 0)
+		return 0;
+	return wait < timeout ? (int)wait + 1 : timeout;
+}
+
+/* sample and move the memory target if it is time, returns 1 if it moved */
+static int adjust_setpoint(struct wastebin_request *req, char *cmdstr)
+{
+	long target = req->membytes, step = 0, avail = 0;
+	double psi = 0;
+
+	if (req->setpoint == SETPOINT_NONE ||
+	    elapsed_since(&setpoint_tick) * 1000 < setpoint_period_ms)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &setpoint_tick);
+	if (req->setpoint == SETPOINT_AVAIL) {
+		avail = memory_available();
+		if (avail < 0) {
+			fprintf(stderr, "%s: no available memory figure, holding %'ld bytes\n",
+				cmdstr, target);
+			req->setpoint = SETPOINT_NONE;
+			return 0;
+		}
+		if (labs(avail - (long)req->setpoint_value) > setpoint_deadband)
+			step = (avail - (long)req->setpoint_value) / 2;
+	} else {
+		psi = memory_pressure();
+		if (psi < 0) {
+			fprintf(stderr, "%s: no memory pressure information, holding %'ld bytes\n",
+				cmdstr, target);
+			req->setpoint = SETPOINT_NONE;
+			return 0;
+		}
+		if (psi > req->setpoint_value) {
+			step = -(target / 4 > setpoint_psi_step ? target / 4 : setpoint_psi_step);
+			setpoint_backoff = setpoint_tick;
+		} else if (psi < req->setpoint_value / 2 &&
+			   (setpoint_backoff.tv_sec == 0 ||
+			    elapsed_since(&setpoint_backoff) > setpoint_psi_settle)) {
+			step = setpoint_psi_step;
+		}
+	}
+	if (step > setpoint_max_grow)
+		step = setpoint_max_grow;
+	if (step < -setpoint_max_shrink)
+		step = -setpoint_max_shrink;
+	target += step;
+	if (target < 0)
+		target = 0;
+	if (target > wastebin_mem_max)
+		target = wastebin_mem_max;
+	target = round_to_page(target);
+	if (target == req->membytes)
+		return 0;
+	if (req->setpoint == SETPOINT_AVAIL)
+		printf("%s: %s %'ld bytes, setpoint %'.0f, moving target to %'ld\n", cmdstr,
+		       wastebin_mem_backend == MEM_CGROUP ? "cgroup headroom" : "MemAvailable",
+		       avail, req->setpoint_value, target);
+	else
+		printf("%s: memory pressure %.2f%%, setpoint %.2f%%, moving target to %'ld\n",
+		       cmdstr, psi, req->setpoint_value, target);
+	fflush(stdout);
+	req->membytes = target;
+	return 1;
+}
+
+/*
+ * Sweeps. 'wastebin sweep' runs a workload at each point of a grid of memory and
+ * cpu targets and finds the smallest machine that still performs. Each point is
+ * set by running this program again with -w and the options given before
+ * "sweep", so the first point starts the daemon. The workload's wall time and
+ * rusage are recorded, and its throughput if --metric gives a regular expression
+ * that finds it in the workload's output (the first subexpression, or the whole
+ * match, of the last match). The full machine, 0 and 0, is always measured first
+ * as the baseline, and the knee is the point that takes the most cpus, then the
+ * most memory, while staying within the tolerance of the baseline. Everything is
+ * given back when the sweep is done.
+ */
+struct sweep_result {
+	long membytes, cpus;
+	double wall, user, sys;
+	long maxrss;		/* KiB */
+	int status;		/* exit status, or 128 + signal */
+	int have_metric;
+	double metric;
+	int within;
+};
+
+static const struct option sweep_options[] = {
+	{ "mem",	required_argument,	NULL, 'm' },
+	{ "cpus",	required_argument,	NULL, 'c' },
+	{ "metric",	required_argument,	NULL, 'M' },
+	{ "lower",	no_argument,		NULL, 'l' },
+	{ "tolerance",	required_argument,	NULL, 't' },
+	{ "format",	required_argument,	NULL, 'f' },
+	{ "output",	required_argument,	NULL, 'o' },
+	{ NULL,		0,			NULL, 0 }
+};
+
+/* parse points such as 0,16G,32G or 0..64G step 16G, returns the count or -1 */
+static int parse_points(char *arg, int is_mem, long **points)
+{
+	long from, to, step, v;
+	char a[32], b[32], c[32], *copy, *tok, *save;
+	int n = 0, end = -1;
+
+	if (sscanf(arg, " %31[^.]..%31s step %31s %n", a, b, c, &end) == 3 && arg[end] == '\0') {
+		from = is_mem ? strm2ul(a) : str2ul(a);
+		to = is_mem ? strm2ul(b) : str2ul(b);
+		step = is_mem ? strm2ul(c) : str2ul(c);
+		if (from < 0 || to < from || step <= 0)
+			return -1;
+		*points = calloc((to - from) / step + 2, sizeof(long));
+		if (*points == NULL)
+			return -1;
+		for (v = from; v < to; v += step)
+			(*points)[n++] = v;
+		(*points)[n++] = to;
+		return n;
+	}
+	copy = strdup(arg);
+	*points = calloc(strlen(arg) / 2 + 1, sizeof(long));
+	if (copy == NULL || *points == NULL)
+		return -1;
+	for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		v = is_mem ? strm2ul(tok) : str2ul(tok);
+		if (v < 0) {
+			n = -1;
+			break;
+		}
+		(*points)[n++] = v;
+	}
+	free(copy);
+	return n;
+}
+
+/* set the targets by running this program with -w and the daemon options */
+static void sweep_set(char **opts, int nopts, long membytes, long cpus, char *cmdstr)
+{
+	char mem[32], ncpus[32];
+	char *args[nopts + 5];
+	int status, i;
+	pid_t pid;
+
+	snprintf(mem, sizeof(mem), "%ld", membytes);
+	snprintf(ncpus, sizeof(ncpus), "%ld", cpus);
+	args[0] = cmdstr;
+	for (i = 0; i < nopts; i++)
+		args[i + 1] = opts[i];
+	args[i + 1] = "-w";
+	args[i + 2] = mem;
+	args[i + 3] = ncpus;
+	args[i + 4] = NULL;
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		/* keep stdout for the results */
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		execv("/proc/self/exe", args);
+		_exit(127);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: couldn't set %ld cpus and %'ld bytes\n", cmdstr, cpus, membytes);
+		/* don't leave the daemon holding an earlier point */
+		if (membytes != 0 || cpus != 0)
+			sweep_set(opts, nopts, 0, 0, cmdstr);
+		fail_exit("sweeping", cmdstr);
+	}
+}
+
+/* run the workload once, copying its output to stderr and finding the metric */
+static void sweep_run(char **workload, regex_t *metric, struct sweep_result *res, char *cmdstr)
+{
+	static char out[1 << 20];
+	size_t len = 0;
+	struct timespec start;
+	struct rusage ru;
+	regmatch_t m[2];
+	char *at;
+	int fds[2], status;
+	ssize_t nb;
+	pid_t pid;
+
+	if (pipe(fds) < 0)
+		fail_exit("creating workload pipe", cmdstr);
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[1]);
+		execvp(workload[0], workload);
+		fprintf(stderr, "%s: can't run %s: %s\n", cmdstr, workload[0], strerror(errno));
+		_exit(127);
+	}
+	close(fds[1]);
+	if (pid < 0)
+		fail_exit("starting workload", cmdstr);
+	/* keep the end of the output, where results usually are */
+	while ((nb = read(fds[0], out + len, sizeof(out) - 1 - len)) > 0 ||
+	       (nb < 0 && errno == EINTR)) {
+		if (nb <= 0)
+			continue;
+		if (write(STDERR_FILENO, out + len, nb) < 0)
+			;	/* the copy is only for watching */
+		len += nb;
+		if (len == sizeof(out) - 1) {
+			memmove(out, out + len / 2, len - len / 2);
+			len -= len / 2;
+		}
+	}
+	close(fds[0]);
+	out[len] = '\0';
+	if (wait4(pid, &status, 0, &ru) < 0)
+		fail_exit("waiting for workload", cmdstr);
+	res->wall = elapsed_since(&start);
+	res->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	res->sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	res->maxrss = ru.ru_maxrss;
+	res->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	res->have_metric = 0;
+	for (at = out; metric != NULL && at <= out + len &&
+	     regexec(metric, at, 2, m, at == out ? 0 : REG_NOTBOL) == 0;
+	     at += m[0].rm_eo > 0 ? m[0].rm_eo : 1) {
+		int sub = m[1].rm_so >= 0 ? 1 : 0;
+		res->metric = strtod(at + m[sub].rm_so, NULL);
+		res->have_metric = 1;
+	}
+}
+
+static void sweep_output(FILE *fh, int json, struct sweep_result *res, int n, int knee,
+			 double tolerance)
+{
+	if (!json) {
+		fprintf(fh, "mem_bytes,cpus,wall_s,user_s,sys_s,maxrss_kb,exit,metric,within\n");
+		for (int i = 0; i < n; i++) {
+			fprintf(fh, "%ld,%ld,%.6f,%.6f,%.6f,%ld,%d,", res[i].membytes, res[i].cpus,
+				res[i].wall, res[i].user, res[i].sys, res[i].maxrss, res[i].status);
+			if (res[i].have_metric)
+				fprintf(fh, "%.17g", res[i].metric);
+			fprintf(fh, ",%d\n", res[i].within);
+		}
+		return;
+	}
+	fprintf(fh, "{\n  \"tolerance_pct\": %g,\n  \"points\": [\n", tolerance);
+	for (int i = 0; i < n; i++) {
+		fprintf(fh, "    { \"mem_bytes\": %ld, \"cpus\": %ld, \"wall_s\": %.6f, "
+			"\"user_s\": %.6f, \"sys_s\": %.6f, \"maxrss_kb\": %ld, \"exit\": %d, "
+			"\"metric\": ", res[i].membytes, res[i].cpus, res[i].wall, res[i].user,
+			res[i].sys, res[i].maxrss, res[i].status);
+		if (res[i].have_metric)
+			fprintf(fh, "%.17g", res[i].metric);
+		else
+			fprintf(fh, "null");
+		fprintf(fh, ", \"within\": %s }%s\n", res[i].within ? "true" : "false",
+			i + 1 < n ? "," : "");
+	}
+	fprintf(fh, "  ],\n  \"knee\": ");
+	if (knee >= 0)
+		fprintf(fh, "{ \"mem_bytes\": %ld, \"cpus\": %ld }\n}\n",
+			res[knee].membytes, res[knee].cpus);
+	else
+		fprintf(fh, "null\n}\n");
+}
+
+/* 'wastebin [options] sweep ...', opts are the options given before "sweep" */
+static int sweep_main(int argc, char **argv, char **opts, int nopts, char *cmdstr)
+{
+	long *mems = NULL, *cpus = NULL, base;
+	long zero = 0;
+	int nmems = -1, ncpus = -1, lower = 0, json = 0, opt, n = 0, knee = -1, base_ok;
+	double tolerance = 5, perf, base_perf;
+	char *metricarg = NULL, *endp;
+	regex_t metric;
+	struct sweep_result *res;
+	FILE *fh = stdout;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "+m:c:M:lt:f:o:", sweep_options, NULL)) != -1)
+		switch (opt) {
+		case 'm':
+			if ((nmems = parse_points(optarg, 1, &mems)) <= 0)
+				badarg_exit("mem", optarg, cmdstr);
+			break;
+		case 'c':
+			if ((ncpus = parse_points(optarg, 0, &cpus)) <= 0)
+				badarg_exit("cpus", optarg, cmdstr);
+			break;
+		case 'M':
+			metricarg = optarg;
+			if (regcomp(&metric, optarg, REG_EXTENDED) != 0)
+				badarg_exit("metric", optarg, cmdstr);
+			break;
+		case 'l':
+			lower = 1;
+			break;
+		case 't':
+			tolerance = strtod(optarg, &endp);
+			if (*endp != '\0' || tolerance < 0)
+				badarg_exit("tolerance", optarg, cmdstr);
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0)
+				badarg_exit("format", optarg, cmdstr);
+			json = strcmp(optarg, "json") == 0;
+			break;
+		case 'o':
+			fh = fopen(optarg, "w");
+			if (fh == NULL)
+				badarg_exit("output", optarg, cmdstr);
+			break;
+		default:
+			usage_exit(EXIT_FAILURE, cmdstr);
+		}
+	if (optind >= argc)
+		usage_exit(EXIT_FAILURE, cmdstr);
+	if (nmems < 0) {
+		mems = &zero;
+		nmems = 1;
+	}
+	if (ncpus < 0) {
+		cpus = &zero;
+		ncpus = 1;
+	}
+	/* without a metric, performance is the wall time */
+	if (metricarg == NULL)
+		lower = 1;
+	res = calloc(nmems * ncpus + 1, sizeof(*res));
+	if (res == NULL)
+		fail_exit("allocating sweep", cmdstr);
+
+	for (int i = -1; i < nmems * ncpus; i++) {
+		struct sweep_result *r = &res[n];
+		r->membytes = i < 0 ? 0 : mems[i / ncpus];
+		r->cpus = i < 0 ? 0 : cpus[i % ncpus];
+		if (i >= 0 && r->membytes == 0 && r->cpus == 0)
+			continue;	/* the baseline */
+		fprintf(stderr, "%s: sweep point %d, %ld cpus and %'ld bytes\n", cmdstr, n + 1,
+			r->cpus, r->membytes);
+		sweep_set(opts, nopts, r->membytes, r->cpus, cmdstr);
+		sweep_run(argv + optind, metricarg ? &metric : NULL, r, cmdstr);
+		if (metricarg != NULL && !r->have_metric)
+			fprintf(stderr, "%s: no metric in the workload's output\n", cmdstr);
+		n++;
+	}
+	sweep_set(opts, nopts, 0, 0, cmdstr);
+
+	/* compare every point with the baseline */
+	base = 0;
+	base_ok = res[base].status == 0 && (metricarg == NULL || res[base].have_metric);
+	base_perf = metricarg ? res[base].metric : res[base].wall;
+	for (int i = 0; base_ok && i < n; i++) {
+		perf = metricarg ? res[i].metric : res[i].wall;
+		res[i].within = res[i].status == 0 && (metricarg == NULL || res[i].have_metric) &&
+			(lower ? perf <= base_perf * (1 + tolerance / 100) :
+			 perf >= base_perf * (1 - tolerance / 100));
+		if (res[i].within && (knee < 0 || res[i].cpus > res[knee].cpus ||
+				      (res[i].cpus == res[knee].cpus &&
+				       res[i].membytes > res[knee].membytes)))
+			knee = i;
+	}
+	if (!base_ok)
+		fprintf(stderr, "%s: the baseline run failed, no point is within tolerance\n", cmdstr);
+	else if (knee >= 0)
+		fprintf(stderr, "%s: knee at %ld cpus and %'ld bytes taken, within %g%% of the "
+			"full machine\n", cmdstr, res[knee].cpus, res[knee].membytes, tolerance);
+	sweep_output(fh, json, res, n, knee, tolerance);
+	if (fh != stdout)
+		fclose(fh);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Benchmarks. 'wastebin bench' times the primitives that transitions are made of
+ * on this host, without a daemon: locking a region with each chunk size and
+ * number of lock threads, scanning it with mincore() and releasing it with each
+ * madvise, with 4 KiB pages, THP and, if the pool has room, 2 MiB hugetlb pages.
+ * With --hotplug it also times taking every cpu that can go offline offline and
+ * back online. Every result is the median of --repeat runs, written as CSV or
+ * JSON with a row per measurement, to tune the options and compare kernels.
+ */
+struct bench_result {
+	const char *test;	/* lock, mincore, release-<advice>, offline or online */
+	const char *pages;	/* 4k, thp or 2m, or "" for hotplug */
+	size_t chunk;
+	unsigned threads;
+	int cpu;		/* the cpu for hotplug, else -1 */
+	size_t bytes;
+	double secs;
+};
+static struct bench_result *bench_results = NULL;
+static int bench_nresults = 0;
+
+struct bench_pages {
+	const char *name;
+	int flags;		/* extra mmap flags */
+	size_t size;
+};
+static const struct bench_pages bench_page_kinds[] = {
+	{ "4k", 0, 4096 },
+	{ "thp", 0, 2UL << 20 },
+	{ "2m", MAP_HUGETLB | MAP_HUGE_2MB, 2UL << 20 },
+};
+static const struct { const char *name; int advice; } bench_releases[] = {
+	{ "release-dontneed", MADV_DONTNEED },
+	{ "release-free", MADV_FREE },
+};
+
+static const struct option bench_options[] = {
+	{ "size",	required_argument,	NULL, 's' },
+	{ "repeat",	required_argument,	NULL, 'r' },
+	{ "hotplug",	no_argument,		NULL, 'p' },
+	{ "format",	required_argument,	NULL, 'f' },
+	{ "output",	required_argument,	NULL, 'o' },
+	{ NULL,		0,			NULL, 0 }
+};
+
+/* record the median of n timings */
+static void bench_add(struct bench_result r, double *secs, int n, char *cmdstr)
+{
+	qsort(secs, n, sizeof(*secs), compare_double);
+	r.secs = secs[n / 2];
+	bench_results = realloc(bench_results, (bench_nresults + 1) * sizeof(*bench_results));
+	if (bench_results == NULL)
+		fail_exit("allocating bench results", cmdstr);
+	bench_results[bench_nresults++] = r;
+	if (r.bytes)
+		fprintf(stderr, "%s: %s %s chunk %'lu threads %u: %.3f s, %.2f GiB/s\n", cmdstr,
+			r.test, r.pages, r.chunk, r.threads, r.secs,
+			r.bytes / (r.secs > 0 ? r.secs : 1e-9) / (1L << 30));
+	else
+		fprintf(stderr, "%s: %s cpu %d: %.3f ms\n", cmdstr, r.test, r.cpu, r.secs * 1e3);
+}
+
+/* map len bytes of a kind of page, aligned to the page. returns NULL if it can't */
+static char *bench_map(const struct bench_pages *kind, size_t len)
+{
+	size_t extra = kind->flags ? 0 : kind->size;
+	char *raw, *base;
+
+	raw = mmap(NULL, len + extra, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | kind->flags, -1, 0);
+	if (raw == MAP_FAILED)
+		return NULL;
+	base = (char *)(((size_t)raw + kind->size - 1) & ~(kind->size - 1));
+	if (base != raw)
+		munmap(raw, base - raw);
+	if (extra)
+		munmap(base + len, extra - (base - raw));
+	if (!kind->flags)
+		madvise(base, len, kind->size > 4096 ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+	return base;
+}
+
+/* lock the range in chunks from threads pinned to online cpus, returns seconds */
+static double bench_lock(char *base, size_t len, size_t chunk, unsigned threads, char *cmdstr)
 {
-	char sysfile[64];
-	size_t nb;
-	int fh;
-	char digit;
+	struct lock_job job = { base, base, len, chunk, 0, 0, 0, 0, 0, cmdstr, 0, len, 0,
+				{ 0, 0 }, { 0, 0 } };
+	pthread_t tids[threads];
+	pthread_attr_t attr;
+	struct timespec start;
+	unsigned cpu = 0, started;
 
-	nb = snprintf(sysfile, sizeof(sysfile) - 1, "/sys/devices/system/cpu/cpu%u/online", cpu);
-	sysfile[nb] = '\0';
-	fh = open(sysfile, O_WRONLY);
-	if (fh < 0) {
-		perror("opening cpu online state file");
-		fflush(stderr);
-		exit(EXIT_FAILURE);
-	}
-	digit = "01"[(int)online_state];
-	nb = write(fh, &digit, sizeof(digit));
-	if (nb < sizeof(digit)) {
-		perror("writing online state");
-		fflush(stderr);
-		exit(EXIT_FAILURE);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (started = 0; started < threads; started++) {
+		pthread_attr_init(&attr);
+		cpu = next_id(cpus_online, nr_cpu_ids, cpu, 0);
+		if (cpu == nr_cpu_ids)
+			cpu = next_id(cpus_online, nr_cpu_ids, 0, 0);
+		if (cpu < nr_cpu_ids)
+			pin_thread_attr(&attr, cpu);
+		cpu++;
+		if (pthread_create(&tids[started], &attr, lock_worker, &job) != 0)
+			fail_exit("starting lock threads", cmdstr);
+		pthread_attr_destroy(&attr);
 	}
-	close(fh);
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	if (job.err != 0)
+		lock_fail_exit(job.err, cmdstr);
+	return elapsed_since(&start);
 }
 
-static void parse_sysfs_cpu_set(char *syscpuset, char *cpu_states)
+static void bench_memory(const struct bench_pages *kind, size_t len, int repeat, char *cmdstr)
 {
-	char sysfile[64];
-	char buf[4096];
-	size_t nb;
-	int np;
-	int nxt;
-	int fh;
-	nb = snprintf(sysfile, sizeof(sysfile) - 1, "/sys/devices/system/cpu/%s", syscpuset);
-	sysfile[nb] = '\0';
+	size_t chunks[] = { 16L << 20, 64L << 20, 256L << 20, 1L << 30 };
+	unsigned online = count_cpu_set(cpus_online);
+	size_t chunk = 64L << 20;
+	double secs[repeat];
+	struct timespec start;
+	char *base;
 
-	/* read sysfs file to get cpu set as string */
-	fh = open(sysfile, O_RDONLY);
-	if (fh < 0) return;
-	nb = read(fh, &buf, sizeof(buf));
-	close(fh);
-	if (nb < 0 || nb == sizeof(buf))
-		return;
-	buf[nb] = '\0';
+	for (unsigned threads = 1; threads <= online; threads = threads * 2 > online &&
+	     threads < online ? online : threads * 2)
+		for (unsigned c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+			if (chunks[c] > len && c > 0)
+				break;
+			for (int i = 0; i < repeat; i++) {
+				if ((base = bench_map(kind, len)) == NULL)
+					fail_exit("mapping memory to lock", cmdstr);
+				secs[i] = bench_lock(base, len, chunks[c], threads, cmdstr);
+				munmap(base, len);
+			}
+			bench_add((struct bench_result){ "lock", kind->name, chunks[c], threads,
+							  -1, len, 0 }, secs, repeat, cmdstr);
+		}
 
-	/* parse scan over each comma separated group until newline or end of read */
-	nxt = 0;
-	do {
-		unsigned u, ul;
-		char c;
-		int nd, end, nl, nle;
-
-		np = sscanf(buf + nxt, "%u%n%1[,-]%n", &u, &nd, &c, &end);
-		/* converts unsigned, checks for continuation by - or , */
-		switch (np) {
-		case EOF:
-		case 0:
-			/* invalid syntax encountered, just give up */
-			fprintf(stderr, "invalid chars remaining after %d parsed, '%s'\n", nxt, buf + nxt);
-			return;
-		case 1:
-			/* number not followed by valid continuation, nd contains bytes scanned  */
-			if (u < max_cpu_count)
-				cpu_states[u] = 1;
-			nxt += nd;
-			break;
-		case 2:
-			nxt += end;
-			switch (c) {
-			case '-':
-				np = sscanf(buf + nxt, "%u%n%[,]%n", &ul, &nl, &c, &nle);
-				switch (np) {
-				case EOF:
-				case 0:
-					/* syntax error */
-					fprintf(stderr, "invalid chars remaining after %d parsed, '%s'\n", nxt, buf + nxt);
-					return;
-				case 1:
-					nxt += nl; /* if non-null chars here, it can't be digit, so we fail */
-					break;
-				case 2:
-					nxt += nle;
-					break;			
-				}
-				/* cpus from u:ul are present, comma not found */
-				if (u < max_cpu_count && ul < max_cpu_count)
-					for (unsigned i = u; i <= ul; i++)
-						cpu_states[i] = 1;
+	/* what follows locking: the mincore audit, then each way of releasing */
+	for (unsigned r = 0; r < sizeof(bench_releases) / sizeof(bench_releases[0]); r++) {
+		double scans[repeat];
+		int ok = 1;
+		for (int i = 0; i < repeat; i++) {
+			if ((base = bench_map(kind, len)) == NULL)
+				fail_exit("mapping memory to lock", cmdstr);
+			bench_lock(base, len, chunk, 1, cmdstr);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			count_incore(base, len);
+			scans[i] = elapsed_since(&start);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			munlock(base, len);
+			ok = madvise(base, len, bench_releases[r].advice) == 0;
+			secs[i] = elapsed_since(&start);
+			munmap(base, len);
+			if (!ok)
 				break;
-			case ',':
-				/* have eaten the comma here */
-				if (u < max_cpu_count) cpu_states[u] = 1;
+		}
+		if (r == 0)
+			bench_add((struct bench_result){ "mincore", kind->name, 0, 1, -1, len, 0 },
+				  scans, repeat, cmdstr);
+		if (ok)
+			bench_add((struct bench_result){ bench_releases[r].name, kind->name, chunk,
+							  1, -1, len, 0 }, secs, repeat, cmdstr);
+		else
+			fprintf(stderr, "%s: %s isn't supported with %s pages\n", cmdstr,
+				bench_releases[r].name, kind->name);
+	}
+}
+
+/* time each cpu that can go offline going offline and back online */
+static void bench_hotplug(int repeat, char *cmdstr)
+{
+	double off[repeat], on[repeat];
+	struct timespec start;
+	char path[64];
+	unsigned cpu;
+	int i;
+
+	for_each_id(cpu, cpus_online, nr_cpu_ids) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/online", cpu);
+		if (access(path, W_OK) != 0)
+			continue;
+		for (i = 0; i < repeat; i++) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (write_file(path, "0") < 0)
 				break;
+			off[i] = elapsed_since(&start);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (write_file(path, "1") < 0) {
+				fprintf(stderr, "%s: cpu %u did not come back online\n", cmdstr, cpu);
+				fail_exit("bringing cpu back online", cmdstr);
 			}
+			on[i] = elapsed_since(&start);
+		}
+		if (i < repeat) {
+			fprintf(stderr, "%s: cpu %u can't go offline: %s\n", cmdstr, cpu,
+				strerror(errno));
+			continue;
 		}
-	} while(nxt != nb && buf[nxt] != '\n');
+		bench_add((struct bench_result){ "offline", "", 0, 1, cpu, 0, 0 }, off, repeat,
+			  cmdstr);
+		bench_add((struct bench_result){ "online", "", 0, 1, cpu, 0, 0 }, on, repeat,
+			  cmdstr);
+	}
 }
 
-static unsigned count_cpu_set(char *cpu_states)
+static void bench_output(FILE *fh, int json, size_t size, int repeat)
 {
-	unsigned count = 0;
-	for (unsigned i = 0; i < max_cpu_count; i++)
-		count += cpu_states[i];
-	return count;
+	struct bench_result *r;
+
+	if (!json)
+		fprintf(fh, "test,pages,chunk_bytes,threads,cpu,bytes,seconds,gib_per_s\n");
+	else
+		fprintf(fh, "{\n  \"size_bytes\": %lu,\n  \"repeat\": %d,\n  \"results\": [\n",
+			size, repeat);
+	for (int i = 0; i < bench_nresults; i++) {
+		r = &bench_results[i];
+		if (!json) {
+			fprintf(fh, "%s,%s,%lu,%u,%d,%lu,%.6f,", r->test, r->pages, r->chunk,
+				r->threads, r->cpu, r->bytes, r->secs);
+			if (r->bytes)
+				fprintf(fh, "%.3f", r->bytes / r->secs / (1L << 30));
+			fprintf(fh, "\n");
+			continue;
+		}
+		fprintf(fh, "    { \"test\": \"%s\", \"pages\": \"%s\", \"chunk_bytes\": %lu, "
+			"\"threads\": %u, \"cpu\": %d, \"bytes\": %lu, \"seconds\": %.6f, "
+			"\"gib_per_s\": ", r->test, r->pages, r->chunk, r->threads, r->cpu,
+			r->bytes, r->secs);
+		if (r->bytes)
+			fprintf(fh, "%.3f", r->bytes / r->secs / (1L << 30));
+		else
+			fprintf(fh, "null");
+		fprintf(fh, " }%s\n", i + 1 < bench_nresults ? "," : "");
+	}
+	if (json)
+		fprintf(fh, "  ]\n}\n");
+}
+
+/* 'wastebin [options] bench ...' */
+static int bench_main(int argc, char **argv, char *cmdstr)
+{
+	long size = 1L << 30, avail = meminfo_bytes("MemAvailable");
+	int repeat = 3, hotplug = 0, json = 0, opt;
+	FILE *fh = stdout;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "+s:r:pf:o:", bench_options, NULL)) != -1)
+		switch (opt) {
+		case 's':
+			if ((size = strm2ul(optarg)) <= 0)
+				badarg_exit("size", optarg, cmdstr);
+			break;
+		case 'r':
+			if ((repeat = str2ul(optarg)) <= 0)
+				badarg_exit("repeat", optarg, cmdstr);
+			break;
+		case 'p':
+			hotplug = 1;
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0)
+				badarg_exit("format", optarg, cmdstr);
+			json = strcmp(optarg, "json") == 0;
+			break;
+		case 'o':
+			fh = fopen(optarg, "w");
+			if (fh == NULL)
+				badarg_exit("output", optarg, cmdstr);
+			break;
+		default:
+			usage_exit(EXIT_FAILURE, cmdstr);
+		}
+	if (optind < argc)
+		usage_exit(EXIT_FAILURE, cmdstr);
+	/* leave the host half of what it has available */
+	if (avail > 0 && size > avail / 2) {
+		size = avail / 2;
+		fprintf(stderr, "%s: benchmarking with %'ld bytes, half of MemAvailable\n",
+			cmdstr, size);
+	}
+	size &= ~((2L << 20) - 1);
+	if (size == 0)
+		fail_exit("not enough memory available to benchmark", cmdstr);
+	parse_sysfs_cpu_set("online", cpus_online);
+	if (count_cpu_set(cpus_online) == 0)
+		add_id(cpus_online, 0);
+
+	for (unsigned k = 0; k < sizeof(bench_page_kinds) / sizeof(bench_page_kinds[0]); k++) {
+		const struct bench_pages *kind = &bench_page_kinds[k];
+		if (kind->flags && read_sysfs_long("/sys/kernel/mm/hugepages/hugepages-%lukB/"
+						   "free_hugepages", kind->size >> 10) <
+		    (long)(size / kind->size)) {
+			fprintf(stderr, "%s: not enough free %s hugetlb pages, skipping them\n",
+				cmdstr, kind->name);
+			continue;
+		}
+		bench_memory(kind, size, repeat, cmdstr);
+	}
+	if (hotplug)
+		bench_hotplug(repeat, cmdstr);
+	bench_output(fh, json, size, repeat);
+	if (fh != stdout)
+		fclose(fh);
+	return EXIT_SUCCESS;
 }
 
-static void show_cpu_set(char *syscpuset, char *cpu_states)
+/*
+ * Decoding event logs. Records are printed with their wall clock time, from the
+ * header of their file, and the duration in seconds. Files of other versions or
+ * record sizes are refused rather than misread.
+ */
+static const struct option decode_options[] = {
+	{ "format",	required_argument,	NULL, 'f' },
+	{ NULL,		0,			NULL, 0 }
+};
+
+static int decode_events(const char *path, int json, char *cmdstr)
 {
-	for (unsigned idx = 0; idx < max_cpu_count; idx++)
-		if (cpu_states[idx])
-			printf("CPU %u is %s\n", idx, syscpuset);
+	struct wastebin_event_header h;
+	struct wastebin_event ev;
+	const char *name;
+	double t;
+	FILE *fh = fopen(path, "r");
+
+	if (fh == NULL) {
+		fprintf(stderr, "%s: can't open %s\n", cmdstr, path);
+		return -1;
+	}
+	if (fread(&h, sizeof(h), 1, fh) != 1 || h.magic != EVENT_MAGIC ||
+	    h.version != EVENT_VERSION || h.record_size != sizeof(ev)) {
+		fprintf(stderr, "%s: %s is not an event log of this version\n", cmdstr, path);
+		fclose(fh);
+		return -1;
+	}
+	while (fread(&ev, sizeof(ev), 1, fh) == 1) {
+		t = (h.real_ns + (ev.ns - h.mono_ns)) * 1e-9;
+		name = ev.type < EV_NTYPES ? event_names[ev.type] : "unknown";
+		if (!json)
+			printf("%.6f,%s,%u,%ld,%ld,%d,%d,%.6f,%ld\n", t, name, ev.gen,
+			       (long)ev.target_membytes, (long)ev.membytes, ev.target_cpus,
+			       ev.cpus, ev.duration_ns * 1e-9, (long)ev.value);
+		else
+			printf("{ \"time\": %.6f, \"event\": \"%s\", \"request\": %u, "
+			       "\"target_membytes\": %ld, \"membytes\": %ld, \"target_cpus\": %d, "
+			       "\"cpus\": %d, \"seconds\": %.6f, \"value\": %ld }\n", t, name,
+			       ev.gen, (long)ev.target_membytes, (long)ev.membytes,
+			       ev.target_cpus, ev.cpus, ev.duration_ns * 1e-9, (long)ev.value);
+	}
+	fclose(fh);
+	return 0;
 }
 
-static void show_incore_memory(char *cmdstr)
+static int decode_main(int argc, char **argv, char *cmdstr)
 {
-	unsigned char ic_vec[4096];
-	size_t step = sizeof(ic_vec) << 12;
-	int ec;
-	char *scanp;
-	char *endp = wastebin_memory + wastebin_max_size;
-	size_t pages = 0;
-	for (scanp = wastebin_memory; scanp < endp; scanp += step) { 
-		if (scanp + step > endp) /* partial last step */
-			step = endp - scanp;
-		ec = mincore(scanp, step, ic_vec);
-		if (ec < 0)
-			fprintf(stderr, "mincore failed @%lx, taken was %lx\n",
-				scanp - wastebin_memory, wastebin_memory_taken);
-		else {
-			int npgs = step >> 12;
-			for (int i = 0; i < npgs; i++)
-				if (ic_vec[i] & 1) pages += 1;
+	int json = 0, ec = EXIT_SUCCESS, opt;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "+f:", decode_options, NULL)) != -1)
+		switch (opt) {
+		case 'f':
+			if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0)
+				badarg_exit("format", optarg, cmdstr);
+			json = strcmp(optarg, "json") == 0;
+			break;
+		default:
+			usage_exit(EXIT_FAILURE, cmdstr);
 		}
+	if (optind >= argc)
+		usage_exit(EXIT_FAILURE, cmdstr);
+	if (!json)
+		printf("time,event,request,target_membytes,membytes,target_cpus,cpus,seconds,value\n");
+	for (; optind < argc; optind++)
+		if (decode_events(argv[optind], json, cmdstr) < 0)
+			ec = EXIT_FAILURE;
+	return ec;
+}
+
+/*
+ * Fleets. 'wastebin agent' serves a line protocol over TCP for a controller and
+ * relays each request to the daemon on this host through the control socket,
+ * starting a persistent one with the options given before "agent" if none is
+ * running. A request is a line, and every line is answered with one line:
+ *   query                    state <result> <cpus> <max cpus> <bytes> <max bytes>
+ *   set <mem> [<ncpus>]            <target cpus> <target bytes> <seconds>
+ *   exit                     or exited, or error <reason>
+ * where set answers once the target is reached or superseded, with the seconds
+ * it took the daemon. 'wastebin fleet' is the controller. It connects to every
+ * host at once and queries it, then sends all the sets together after a
+ * barrier, so the hosts change as close to the same moment as possible. A
+ * target such as 50% is resolved by each daemon against its own host. Once
+ * every host has acknowledged, it reports each host's state and latency and may
+ * run a command, with everything given back afterwards if asked (-r).
+ * Anyone who can send a set can take the host down, so the agent listens on
+ * loopback unless given an address, and only with a key file (-k) on any other.
+ * With a key the first line must then be 'auth <key>', answered with ok, and
+ * anything else closes the connection. The key is sent in the clear, so other
+ * networks than a trusted one need a tunnel.
+ */
+#define fleet_port "7970"
+#define fleet_line_max 2048
+
+static const struct option agent_options[] = {
+	{ "listen",	required_argument,	NULL, 'l' },
+	{ "key",	required_argument,	NULL, 'k' },
+	{ NULL,		0,			NULL, 0 }
+};
+
+static const struct option fleet_options[] = {
+	{ "hosts",	required_argument,	NULL, 'H' },
+	{ "key",	required_argument,	NULL, 'k' },
+	{ "timeout",	required_argument,	NULL, 't' },
+	{ "restore",	no_argument,		NULL, 'r' },
+	{ "format",	required_argument,	NULL, 'f' },
+	{ "output",	required_argument,	NULL, 'o' },
+	{ NULL,		0,			NULL, 0 }
+};
+
+static char fleet_key[256];	/* -k option, empty for none */
+
+/*
+ * a TCP socket listening on [<addr>:]<port>, or connected to <host>[:<port>], or -1.
+ * IPv6 addresses go in brackets, as in [::1]:7970. Without an address a socket
+ * listens on loopback only, * listens on every address
+ */
+static int tcp_open(const char *arg, int listening)
+{
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *ai, *a;
+	char name[256], *host = name, *port, *end;
+	int fd = -1, one = 1;
+
+	snprintf(name, sizeof(name), "%s", arg);
+	if (name[0] == '[' && (end = strchr(name, ']')) != NULL) {
+		*end = '\0';
+		host = name + 1;
+		if (end[1] != '\0' && end[1] != ':')
+			return -1;
+		port = end[1] == ':' ? end + 2 : NULL;
+	} else if ((port = strrchr(name, ':')) != NULL) {
+		*port++ = '\0';
+	} else if (listening) {
+		port = name;
+		host = NULL;
 	}
-	printf("%s: now wasting %'lu bytes out of %'lu\n", cmdstr, pages << 12,
-	       wastebin_max_size);
+	if (port == NULL || *port == '\0')
+		port = fleet_port;
+	if (host == NULL || *host == '\0')
+		host = listening ? "127.0.0.1" : NULL;	/* loopback */
+	if (host != NULL && strcmp(host, "*") == 0) {
+		host = NULL;
+		hints.ai_flags = AI_PASSIVE;
+	}
+	if (getaddrinfo(host, port, &hints, &ai) != 0)
+		return -1;
+	for (a = ai; a != NULL && fd < 0; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (listening)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		else
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (listening ? bind(fd, a->ai_addr, a->ai_addrlen) < 0 || listen(fd, 64) < 0 :
+		    connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+/* whether a socket is bound to a loopback address */
+static int is_loopback(int fd)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	if (getsockname(fd, (struct sockaddr *)&ss, &len) < 0)
+		return 0;
+	if (ss.ss_family == AF_INET)
+		return ntohl(((struct sockaddr_in *)&ss)->sin_addr.s_addr) >> 24 == 127;
+	if (ss.ss_family == AF_INET6)
+		return IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6 *)&ss)->sin6_addr);
+	return 0;
+}
+
+/* -k argument, the first line of a file */
+static int read_key(char *path)
+{
+	return read_file(path, fleet_key, sizeof(fleet_key)) < 0 || fleet_key[0] == '\0' ?
+		-1 : 0;
+}
+
+/* whether a line is 'auth <key>', compared in the same time whatever matches */
+static int key_matches(char *line)
+{
+	size_t len = strlen(fleet_key), i;
+	unsigned char diff = 0;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	if (strncmp(line, "auth ", 5) != 0 || strlen(line + 5) != len)
+		return 0;
+	for (i = 0; i < len; i++)
+		diff |= line[5 + i] ^ fleet_key[i];
+	return diff == 0;
+}
+
+static char **agent_opts;
+static int agent_nopts;
+static pthread_mutex_t agent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* start a persistent daemon with the agent's daemon options, as sweep_set does */
+static void agent_start_daemon(char *cmdstr)
+{
+	char *args[agent_nopts + 5];
+	int status, i;
+	pid_t pid;
+
+	args[0] = cmdstr;
+	for (i = 0; i < agent_nopts; i++)
+		args[i + 1] = agent_opts[i];
+	args[i + 1] = "-P";
+	args[i + 2] = "-w";
+	args[i + 3] = "0";
+	args[i + 4] = NULL;
 	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		execv("/proc/self/exe", args);
+		_exit(127);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		fprintf(stderr, "%s: couldn't start the background process\n", cmdstr);
 }
 
-static void inventory_cpus(void)
+/* answer one line of the protocol */
+static void agent_request(char *line, FILE *out, char *cmdstr)
 {
-	parse_sysfs_cpu_set("online", cpus_online);
-	show_cpu_set("online", cpus_online);
+	struct wastebin_request req = { 0 };
+	struct wastebin_status st;
+	char *save, *verb, *mem, *cpus, *extra;
+	int fd, ec = 0;
+
+	verb = strtok_r(line, " \t\r\n", &save);
+	mem = strtok_r(NULL, " \t\r\n", &save);
+	cpus = strtok_r(NULL, " \t\r\n", &save);
+	extra = strtok_r(NULL, " \t\r\n", &save);
+	if (verb == NULL)
+		return;
+	pthread_mutex_lock(&agent_lock);
+	if (strcmp(verb, "query") == 0 && mem == NULL)
+		req.op = WB_QUERY;
+	else if (strcmp(verb, "exit") == 0 && mem == NULL)
+		req.op = WB_EXIT;
+	else if (strcmp(verb, "set") != 0 || mem == NULL || extra != NULL ||
+		 parse_memarg(mem, &req) < 0 || check_mem_nodes(&req) < 0 ||
+		 parse_cpuarg(cpus ? cpus : "0", &req) < 0)
+		ec = -1;
+	fd = ec < 0 ? -1 : control_connect();
+	if (fd < 0 && ec == 0 && req.op != WB_EXIT) {
+		agent_start_daemon(cmdstr);
+		fd = control_connect();
+	}
+	pthread_mutex_unlock(&agent_lock);
+	if (ec < 0)
+		fprintf(out, "error bad request\n");
+	else if (fd < 0 && req.op != WB_EXIT)
+		fprintf(out, "error no background process\n");
+	else if (fd < 0 || control_call(fd, &req, &st) < 0)
+		fprintf(out, "exited\n");	/* it quits without answering once empty */
+	else
+		fprintf(out, "state %s %ld %ld %ld %ld %ld %ld %.6f\n", result_names[st.result],
+			st.cpus, st.max_cpus, st.membytes, st.max_membytes, st.target_cpus,
+			st.target_membytes, st.elapsed);
+	fflush(out);
+	if (fd >= 0)
+		close(fd);
 }
 
-static void inventory_memory(char *cmdstr)
+static void *agent_serve(void *arg)
 {
-	wastebin_max_size = sysconf(_SC_PHYS_PAGES);
-	if (wastebin_max_size < 0)
-		fail_exit("getting physical memory size", cmdstr);
-	wastebin_max_size <<= 12; /* convert pages to bytes */
-	/* create anonymous private memory segment to waste memory */
-	wastebin_memory = mmap(NULL, wastebin_max_size, PROT_READ | PROT_WRITE,
-			       MAP_PRIVATE | MAP_ANONYMOUS |
-			       MAP_NORESERVE | MAP_NONBLOCK,
-			       -1, 0);
-	if (wastebin_memory == MAP_FAILED) {
-		fail_exit("getting waste memory segment", cmdstr);
+	int fd = (int)(intptr_t)arg;
+	char line[fleet_line_max];
+	FILE *in = fdopen(fd, "r"), *out = fdopen(dup(fd), "w");
+	int authorized = fleet_key[0] == '\0';
+
+	while (in != NULL && out != NULL && fgets(line, sizeof(line), in) != NULL) {
+		if (authorized) {
+			agent_request(line, out, "wastebin agent");
+			continue;
+		}
+		authorized = key_matches(line);
+		fprintf(out, authorized ? "ok\n" : "error not authorized\n");
+		fflush(out);
+		if (!authorized)
+			break;
 	}
-	wastebin_memory_taken = 0;
-	/* disable huge pages in this region so MADV_REMOVE will actually
-	 * succeed. Also disable samepage merging so pages are not merged */
-	madvise(wastebin_memory, wastebin_max_size, MADV_NOHUGEPAGE);
-	madvise(wastebin_memory, wastebin_max_size, MADV_UNMERGEABLE);
+	if (out != NULL)
+		fclose(out);
+	if (in != NULL)
+		fclose(in);
+	else
+		close(fd);
+	return NULL;
+}
 
-	show_incore_memory(cmdstr);
+static int agent_main(int argc, char **argv, char **opts, int nopts, char *cmdstr)
+{
+	char *listenarg = fleet_port;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int listenfd, fd, one = 1, opt;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "+l:k:", agent_options, NULL)) != -1)
+		switch (opt) {
+		case 'l':
+			listenarg = optarg;
+			break;
+		case 'k':
+			if (read_key(optarg) < 0)
+				badarg_exit("key", optarg, cmdstr);
+			break;
+		default:
+			usage_exit(EXIT_FAILURE, cmdstr);
+		}
+	if (optind < argc)
+		usage_exit(EXIT_FAILURE, cmdstr);
+	listenfd = tcp_open(listenarg, 1);
+	if (listenfd < 0)
+		badarg_exit("listen", listenarg, cmdstr);
+	if (!is_loopback(listenfd) && fleet_key[0] == '\0')
+		fail_exit("listening beyond loopback needs a key file, -k", cmdstr);
+	agent_opts = opts;
+	agent_nopts = nopts;
+	signal(SIGPIPE, SIG_IGN);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("%s: agent listening on %s\n", cmdstr, listenarg);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while ((fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) >= 0 ||
+	       errno == EINTR || errno == ECONNABORTED) {
+		if (fd < 0)
+			continue;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (pthread_create(&tid, &attr, agent_serve, (void *)(intptr_t)fd) != 0)
+			close(fd);
+	}
+	fail_exit("accepting a controller", cmdstr);
+	return EXIT_FAILURE;
 }
 
-static void adjust_cpus(unsigned ncpus, char *cmdstr)
+struct fleet_host {
+	char *name;
+	FILE *in, *out;
+	char error[64];		/* why the host failed, or empty */
+	struct wastebin_status st;	/* as of its last answer */
+	double ack;		/* seconds from the barrier to its answer */
+};
+static struct fleet_host *fleet_hosts;
+static int fleet_nhosts;
+static pthread_barrier_t fleet_barrier;
+static char *fleet_mem, *fleet_cpus;	/* targets of the current round */
+static double fleet_timeout = 600;
+
+/* send a line and parse the answer into h->st, returns 0 or -1 with h->error set */
+static int fleet_call(struct fleet_host *h, const char *line)
 {
-	unsigned n_taken;
-	unsigned first_taken = 0;
-	unsigned last_online = max_cpu_count;
-	n_taken = count_cpu_set(cpus_taken);
-	if (n_taken != wastebin_cpus_taken) {
-		fprintf(stderr, "%s: %u cpus taken != %u expected\n",
-			cmdstr, n_taken, wastebin_cpus_taken);
-		fail_exit("adjusting cpus taken", cmdstr);			
+	char buf[fleet_line_max], result[16];
+	int n;
+
+	if (fprintf(h->out, "%s\n", line) < 0 || fflush(h->out) != 0 ||
+	    fgets(buf, sizeof(buf), h->in) == NULL) {
+		snprintf(h->error, sizeof(h->error), "no answer");
+		return -1;
 	}
-		
-	if (ncpus != n_taken)
-		printf("%s: adjust cpus taken to %u\n", cmdstr, ncpus);
-	/* take some  online cpus offline */
-	for (; n_taken < ncpus; n_taken++) {
-		do {
-			last_online -= 1;
-		} while(last_online >= 0 && !cpus_online[last_online]);
-		if (last_online == 0) /* serious problem */
-			fail_exit("can't exhaust online cpus", cmdstr);
-		cpus_online[last_online] = 0;
-		cpus_taken[last_online] = 1;
-		set_cpu_online_state(last_online, 0);
-	}
-	/* put some taken cpus back online */
-	for (; n_taken > ncpus; n_taken--) {
-		while(!cpus_taken[first_taken]) {
-			first_taken += 1;
-		}
-		cpus_taken[first_taken] = 0;
-		cpus_online[first_taken] = 1;
-		set_cpu_online_state(first_taken, 1);
-		first_taken += 1;
-	}
-	wastebin_cpus_taken = ncpus;
-	show_cpu_set("taken", cpus_taken);
+	if (strncmp(buf, "exited", 6) == 0) {
+		/* gave back everything and quit */
+		h->st.result = WB_APPLIED;
+		h->st.cpus = h->st.membytes = 0;
+		return 0;
+	}
+	if (sscanf(buf, "state %15s %ld %ld %ld %ld %ld %ld %lf", result, &h->st.cpus,
+		   &h->st.max_cpus, &h->st.membytes, &h->st.max_membytes, &h->st.target_cpus,
+		   &h->st.target_membytes, &h->st.elapsed) != 8) {
+		buf[strcspn(buf, "\r\n")] = '\0';
+		snprintf(h->error, sizeof(h->error), "%.63s", buf);
+		return -1;
+	}
+	for (n = 0; n < WB_STATUS && strcmp(result, result_names[n]) != 0; n++)
+		;
+	h->st.result = n;
+	return 0;
 }
 
-static void adjust_memory(long membytes, char *cmdstr)
+static void *fleet_worker(void *arg)
 {
-	if (wastebin_memory_taken < membytes) {
-		fprintf(stderr, "%s: mlock called to lock %'lu bytes\n",
-			cmdstr, membytes - wastebin_memory_taken);
-		/* mlock sets all pages to zeros */
-		int ec = mlock(wastebin_memory + wastebin_memory_taken,
-		      membytes - wastebin_memory_taken);
-		fprintf(stderr, "%s: has locked %'lu bytes\n",
-			cmdstr, membytes - wastebin_memory_taken);
-		fflush(stderr);
-		switch (ec) {
-		case 0:
+	struct fleet_host *h = arg;
+	struct timeval tv = { fleet_timeout, (fleet_timeout - (long)fleet_timeout) * 1e6 };
+	char line[fleet_line_max];
+	struct timespec start;
+	int fd, ok = 1;
+
+	if (h->in == NULL) {
+		fd = tcp_open(h->name, 0);
+		if (fd < 0) {
+			snprintf(h->error, sizeof(h->error), "can't connect");
+			ok = 0;
+		} else {
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			h->in = fdopen(fd, "r");
+			h->out = fdopen(dup(fd), "w");
+		}
+		if (ok && fleet_key[0] != '\0' &&
+		    (fprintf(h->out, "auth %s\n", fleet_key) < 0 || fflush(h->out) != 0 ||
+		     fgets(line, sizeof(line), h->in) == NULL || strcmp(line, "ok\n") != 0)) {
+			snprintf(h->error, sizeof(h->error), "not authorized");
+			ok = 0;
+		}
+	}
+	ok = ok && fleet_call(h, "query") == 0;
+	snprintf(line, sizeof(line), "set %s %s", fleet_mem, fleet_cpus);
+	/* every host is ready, send the sets together */
+	pthread_barrier_wait(&fleet_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (ok && fleet_call(h, line) == 0)
+		h->ack = elapsed_since(&start);
+	return NULL;
+}
+
+/* bring every host to mem and cpus, returns how many reached it */
+static int fleet_round(char *mem, char *cpus, char *cmdstr)
+{
+	pthread_t *tids = calloc_or_exit(fleet_nhosts, sizeof(*tids));
+	double first = -1, last = 0;
+	int reached = 0, started;
+
+	fleet_mem = mem;
+	fleet_cpus = cpus;
+	pthread_barrier_init(&fleet_barrier, NULL, fleet_nhosts + 1);
+	for (started = 0; started < fleet_nhosts; started++) {
+		struct fleet_host *h = &fleet_hosts[started];
+		/* try every host again, a late answer may still be on the way */
+		if (h->error[0] != '\0' && h->in != NULL) {
+			fclose(h->in);
+			fclose(h->out);
+			h->in = h->out = NULL;
+		}
+		h->error[0] = '\0';
+		h->ack = -1;
+		if (pthread_create(&tids[started], NULL, fleet_worker, &fleet_hosts[started]) != 0)
+			fail_exit("starting fleet threads", cmdstr);
+	}
+	pthread_barrier_wait(&fleet_barrier);
+	for (int i = 0; i < fleet_nhosts; i++) {
+		struct fleet_host *h = &fleet_hosts[i];
+		pthread_join(tids[i], NULL);
+		if (h->ack < 0 || h->st.result != WB_APPLIED) {
+			fprintf(stderr, "%s: %s did not reach the target: %s\n", cmdstr, h->name,
+				h->error[0] ? h->error : result_names[h->st.result]);
+			continue;
+		}
+		reached++;
+		if (first < 0 || h->ack < first)
+			first = h->ack;
+		if (h->ack > last)
+			last = h->ack;
+	}
+	pthread_barrier_destroy(&fleet_barrier);
+	free(tids);
+	fprintf(stderr, "%s: %d of %d hosts reached %s %s", cmdstr, reached, fleet_nhosts,
+		mem, cpus);
+	if (reached > 0)
+		fprintf(stderr, ", acknowledged from %.3f to %.3f s, a skew of %.3f s",
+			first, last, last - first);
+	fprintf(stderr, "\n");
+	return reached;
+}
+
+static void fleet_output(FILE *fh, int json)
+{
+	if (!json)
+		fprintf(fh, "host,result,cpus,max_cpus,membytes,max_membytes,seconds,ack_seconds\n");
+	else
+		fprintf(fh, "[\n");
+	for (int i = 0; i < fleet_nhosts; i++) {
+		struct fleet_host *h = &fleet_hosts[i];
+		const char *result = h->error[0] ? "failed" : result_names[h->st.result];
+		if (!json)
+			fprintf(fh, "%s,%s,%ld,%ld,%ld,%ld,%.6f,%.6f\n", h->name, result,
+				h->st.cpus, h->st.max_cpus, h->st.membytes, h->st.max_membytes,
+				h->st.elapsed, h->ack);
+		else
+			fprintf(fh, "  { \"host\": \"%s\", \"result\": \"%s\", \"cpus\": %ld, "
+				"\"max_cpus\": %ld, \"membytes\": %ld, \"max_membytes\": %ld, "
+				"\"seconds\": %.6f, \"ack_seconds\": %.6f }%s\n", h->name, result,
+				h->st.cpus, h->st.max_cpus, h->st.membytes, h->st.max_membytes,
+				h->st.elapsed, h->ack, i + 1 < fleet_nhosts ? "," : "");
+	}
+	if (json)
+		fprintf(fh, "]\n");
+}
+
+/* split <host>,<host>... or @<file> with a host per line into fleet_hosts */
+static int parse_hosts(char *arg)
+{
+	char *list, *tok, *save;
+	FILE *fh;
+	long len;
+
+	if (arg[0] == '@') {
+		fh = fopen(arg + 1, "r");
+		if (fh == NULL)
+			return -1;
+		fseek(fh, 0, SEEK_END);
+		len = ftell(fh);
+		rewind(fh);
+		list = calloc(len + 1, 1);
+		if (list == NULL || fread(list, 1, len, fh) != (size_t)len) {
+			fclose(fh);
+			return -1;
+		}
+		fclose(fh);
+	} else {
+		list = strdup(arg);
+		if (list == NULL)
+			return -1;
+	}
+	for (tok = strtok_r(list, ", \t\n", &save); tok != NULL; tok = strtok_r(NULL, ", \t\n", &save)) {
+		fleet_hosts = realloc(fleet_hosts, (fleet_nhosts + 1) * sizeof(*fleet_hosts));
+		if (fleet_hosts == NULL)
+			return -1;
+		fleet_hosts[fleet_nhosts++] = (struct fleet_host){ .name = tok };
+	}
+	return fleet_nhosts > 0 ? 0 : -1;
+}
+
+static int fleet_main(int argc, char **argv, char *cmdstr)
+{
+	char *mem, *cpus = "0", **command = NULL;
+	int restore = 0, json = 0, opt, ec = EXIT_SUCCESS, status;
+	FILE *fh = stdout;
+	pid_t pid;
+
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "+H:k:t:rf:o:", fleet_options, NULL)) != -1)
+		switch (opt) {
+		case 'H':
+			if (parse_hosts(optarg) < 0)
+				badarg_exit("hosts", optarg, cmdstr);
+			break;
+		case 'k':
+			if (read_key(optarg) < 0)
+				badarg_exit("key", optarg, cmdstr);
+			break;
+		case 't':
+			if ((fleet_timeout = parse_duration(optarg)) <= 0)
+				badarg_exit("timeout", optarg, cmdstr);
+			break;
+		case 'r':
+			restore = 1;
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0)
+				badarg_exit("format", optarg, cmdstr);
+			json = strcmp(optarg, "json") == 0;
+			break;
+		case 'o':
+			fh = fopen(optarg, "w");
+			if (fh == NULL)
+				badarg_exit("output", optarg, cmdstr);
 			break;
-		case EPERM:
-			fail_exit("Lock memory requires CAP_IPC_LOCK", cmdstr);
 		default:
-			fail_exit("Can't lock the pages in memory\n", cmdstr);
+			usage_exit(EXIT_FAILURE, cmdstr);
+		}
+	if (fleet_nhosts == 0 || optind >= argc)
+		usage_exit(EXIT_FAILURE, cmdstr);
+	mem = argv[optind++];
+	if (optind < argc && strcmp(argv[optind], "--") != 0)
+		cpus = argv[optind++];
+	if (optind < argc && strcmp(argv[optind], "--") == 0 && optind + 1 < argc)
+		command = argv + optind + 1;
+	else if (optind < argc)
+		usage_exit(EXIT_FAILURE, cmdstr);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (fleet_round(mem, cpus, cmdstr) < fleet_nhosts)
+		ec = EXIT_FAILURE;
+	fleet_output(fh, json);
+	if (fh != stdout)
+		fclose(fh);
+	/* the barrier: run the command only once every host is at the target */
+	if (command != NULL && ec == EXIT_SUCCESS) {
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) {
+			execvp(command[0], command);
+			_exit(127);
 		}
-		wastebin_memory_taken = membytes;
-	} else if (wastebin_memory_taken > membytes) {
-		munlock(wastebin_memory + membytes,
-			wastebin_memory_taken - membytes);
-		madvise(wastebin_memory + membytes,
-			wastebin_memory_taken - membytes, MADV_DONTNEED);
-		wastebin_memory_taken = membytes;
+		if (pid < 0 || waitpid(pid, &status, 0) < 0)
+			fail_exit("running the command", cmdstr);
+		ec = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 	}
-        show_incore_memory(cmdstr);
+	if (restore && fleet_round("0", "0", cmdstr) < fleet_nhosts && ec == EXIT_SUCCESS)
+		ec = EXIT_FAILURE;
+	return ec;
 }
 
+static const struct option long_options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "audit",	no_argument,		NULL, 'a' },
+	{ "wait",	no_argument,		NULL, 'w' },
+	{ "query",	no_argument,		NULL, 'q' },
+	{ "status",	no_argument,		NULL, 's' },
+	{ "cache",	required_argument,	NULL, 'L' },
+	{ "bandwidth",	required_argument,	NULL, 'B' },
+	{ "schedule",	required_argument,	NULL, 'S' },
+	{ "threads",	required_argument,	NULL, 'j' },
+	{ "chunk",	required_argument,	NULL, 'C' },
+	{ "release",	required_argument,	NULL, 'R' },
+	{ "async-release", no_argument,		NULL, 'A' },
+	{ "memfd",	no_argument,		NULL, 'M' },
+	{ "takeover",	no_argument,		NULL, 'X' },
+	{ "persistent",	no_argument,		NULL, 'P' },
+	{ "foreground",	no_argument,		NULL, 'f' },
+	{ "exit",	no_argument,		NULL, 'x' },
+	{ "huge",	required_argument,	NULL, 'H' },
+	{ "numa",	no_argument,		NULL, 'N' },
+	{ "cpu-policy",	required_argument,	NULL, 'c' },
+	{ "hotplug-threads", required_argument,	NULL, 'p' },
+	{ "cpu-backend", required_argument,	NULL, 'b' },
+	{ "mem-backend", required_argument,	NULL, 'm' },
+	{ "fill",	required_argument,	NULL, 'F' },
+	{ "trace",	required_argument,	NULL, 'T' },
+	{ "trace-interval", required_argument,	NULL, 'I' },
+	{ "events",	required_argument,	NULL, 'E' },
+	{ "events-size", required_argument,	NULL, 'Z' },
+	{ NULL, 0, NULL, 0 }
+};
+
 int main(int argc, char *argv[])
 {
 	char *cmdstr = argv[0];
@@ -383,29 +5577,169 @@ int main(int argc, char *argv[])
 	int pid;
 	int logid;
 	FILE *logf;
-	struct {		/* can be sent as a message if server detected */
-		long membytes, cpus;
-	} desired;
-	struct pollfd pipe_poll;
+	struct wastebin_request desired = { 0 };
 	int pipefd;
+	int listenfd;
+	int wait_reply = 0;
+	char *schedarg = NULL;
 	int ec;
+	int opt;
 	ssize_t nb;
 
 	setlocale(LC_ALL, "");
+	size_cpu_sets();
 
-	if (argc < 2 || 0 == strcmp("-h", argv[1]))
+	/* '+' stops option parsing at the first argument, as in <mem> */
+	while ((opt = getopt_long(argc, argv, "+hawqsxL:B:S:j:C:R:AMXPfH:Nc:p:b:m:F:T:I:E:Z:", long_options, NULL)) != -1)
+		switch (opt) {
+		case 'h':
+			usage_exit(EXIT_SUCCESS, cmdstr);
+		case 'a':
+			desired.audit = 1;
+			break;
+		case 'L':
+			if (parse_cachearg(optarg, &desired) < 0)
+				badarg_exit("cache", optarg, cmdstr);
+			break;
+		case 'B':
+			desired.bandwidth_pct = str2ul(optarg);
+			if (desired.bandwidth_pct <= 0 || desired.bandwidth_pct >= 100)
+				badarg_exit("bandwidth", optarg, cmdstr);
+			break;
+		case 'w':
+			wait_reply = 1;
+			break;
+		case 'q':
+			desired.op = WB_QUERY;
+			break;
+		case 's':
+			return show_status_page(cmdstr);
+		case 'x':
+			desired.op = WB_EXIT;
+			break;
+		case 'S':
+			schedarg = optarg;
+			break;
+		case 'j':
+			if (str2ul(optarg) <= 0)
+				badarg_exit("threads", optarg, cmdstr);
+			lock_threads = str2ul(optarg);
+			break;
+		case 'C':
+			if (strm2ul(optarg) <= 0)
+				badarg_exit("chunk", optarg, cmdstr);
+			lock_chunk = strm2ul(optarg);
+			break;
+		case 'R':
+			if (parse_release(optarg) < 0)
+				badarg_exit("release", optarg, cmdstr);
+			wastebin_release = parse_release(optarg);
+			break;
+		case 'A':
+			release_async = 1;
+			break;
+		case 'M':
+			wastebin_use_memfd = 1;
+			break;
+		case 'X':
+			wastebin_use_memfd = wastebin_takeover = 1;
+			break;
+		case 'P':
+			wastebin_persistent = 1;
+			break;
+		case 'f':
+			wastebin_foreground = 1;
+			break;
+		case 'H':
+			if (parse_huge_mode(optarg) < 0)
+				badarg_exit("huge", optarg, cmdstr);
+			wastebin_huge = parse_huge_mode(optarg);
+			break;
+		case 'N':
+			wastebin_numa = 1;
+			break;
+		case 'c':
+			if (parse_cpu_policy(optarg) < 0)
+				badarg_exit("cpu-policy", optarg, cmdstr);
+			wastebin_cpu_policy = parse_cpu_policy(optarg);
+			break;
+		case 'p':
+			if (str2ul(optarg) <= 0)
+				badarg_exit("hotplug-threads", optarg, cmdstr);
+			hotplug_threads = str2ul(optarg);
+			break;
+		case 'b':
+			if (parse_cpu_backend(optarg) < 0)
+				badarg_exit("cpu-backend", optarg, cmdstr);
+			break;
+		case 'm':
+			if (parse_mem_backend(optarg) < 0)
+				badarg_exit("mem-backend", optarg, cmdstr);
+			wastebin_mem_backend = parse_mem_backend(optarg);
+			break;
+		case 'F':
+			if (parse_fill(optarg) < 0)
+				badarg_exit("fill", optarg, cmdstr);
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'I':
+			if (str2ul(optarg) <= 0)
+				badarg_exit("trace-interval", optarg, cmdstr);
+			trace_interval_ms = str2ul(optarg);
+			break;
+		case 'E':
+			events_path = optarg;
+			break;
+		case 'Z':
+			if (strm2ul(optarg) < 0)
+				badarg_exit("events-size", optarg, cmdstr);
+			events_max = strm2ul(optarg);
+			break;
+		default:
+			usage_exit(EXIT_FAILURE, cmdstr);
+		}
+	if (desired.op == WB_QUERY || desired.op == WB_EXIT) {
+		if (optind < argc)
+			usage_exit(EXIT_FAILURE, cmdstr);
+		listenfd = control_connect();
+		if (listenfd < 0)
+			fail_exit("no background process is running", cmdstr);
+		return control_exit(listenfd, &desired, cmdstr);
+	}
+	if (optind < argc && strcmp(argv[optind], "sweep") == 0)
+		return sweep_main(argc - optind, argv + optind, argv + 1, optind - 1, cmdstr);
+	if (optind < argc && strcmp(argv[optind], "bench") == 0)
+		return bench_main(argc - optind, argv + optind, cmdstr);
+	if (optind < argc && strcmp(argv[optind], "agent") == 0)
+		return agent_main(argc - optind, argv + optind, argv + 1, optind - 1, cmdstr);
+	if (optind < argc && strcmp(argv[optind], "fleet") == 0)
+		return fleet_main(argc - optind, argv + optind, cmdstr);
+	if (optind < argc && strcmp(argv[optind], "decode") == 0)
+		return decode_main(argc - optind, argv + optind, cmdstr);
+	if (optind >= argc && schedarg == NULL)
 		usage_exit(EXIT_SUCCESS, cmdstr);
-	memarg = argv[1];
-	if (argc > 2) cpuarg = argv[2];
-	if (argc > 3)
+	memarg = optind < argc ? argv[optind] : "0";
+	if (argc > optind + 1) cpuarg = argv[optind + 1];
+	if (argc > optind + 2)
 		usage_exit(EXIT_FAILURE, cmdstr);
 	
-	desired.cpus = str2ul(cpuarg);
-	if (desired.cpus < 0)
+	if (parse_cpuarg(cpuarg, &desired) < 0)
 		badarg_exit("cpus", cpuarg, cmdstr);
-	desired.membytes = strm2ul(memarg);
-	if (desired.membytes < 0)
+	if (parse_memarg(memarg, &desired) < 0)
 		badarg_exit("memory", memarg, cmdstr);
+	if (check_mem_nodes(&desired) < 0)
+		badarg_exit("memory node", memarg, cmdstr);
+	if (schedarg != NULL && parse_schedule(schedarg, &desired, cmdstr) < 0)
+		badarg_exit("schedule", schedarg, cmdstr);
+	/* each step would move a relative target again */
+	if (schedarg != NULL && (desired.mem_target == TARGET_RELATIVE ||
+				 desired.cpus_target == TARGET_RELATIVE))
+		badarg_exit("schedule", schedarg, cmdstr);
+
+	if (wastebin_takeover)
+		take_over(cmdstr);
 
 	/* create named pipe to adjust wastebin size */
 	ec = mkfifo("/tmp/wastebin", S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
@@ -414,12 +5748,18 @@ int main(int argc, char *argv[])
 		default:
 			fail_exit("Getting pipe", cmdstr);
 		case EEXIST:
-			/* use existing wastebin process */
+			if (schedarg != NULL)
+				fail_exit("a schedule must start the background process", cmdstr);
+			/* use existing wastebin process, over its socket to wait for an answer */
+			if (wait_reply && (listenfd = control_connect()) >= 0)
+				return control_exit(listenfd, &desired, cmdstr);
 			pipefd = open("/tmp/wastebin", O_WRONLY | O_NONBLOCK);
 			if (pipefd >= 0) {
 				/* send command args to wastebin process */
 				nb = write(pipefd, &desired, sizeof(desired)); 
 				close(pipefd);
+				if (nb != sizeof(desired))
+					fail_exit("sending request to /tmp/wastebin", cmdstr);
 				return 0;
 			}
 			fprintf(stderr, "%s: reusing existing /tmp/wastebin\n", cmdstr);
@@ -427,6 +5767,15 @@ int main(int argc, char *argv[])
 	
 	/* after this point, become a "server" to hold onto memory, by daemonizing ourself */
 
+	if (wastebin_foreground) {
+		/* stay in the foreground, logging to stdout and stderr as they are */
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		wastebin_listen = control_listen(cmdstr);
+		fprintf(stderr, "%s: running in the foreground\n", cmdstr);
+		logid = -1;
+		goto serve;
+	}
+
 	/* open a log file to handle server output */
 	logid = open("/tmp/wastebin.log", O_WRONLY | O_APPEND | O_CREAT, S_IRWXU | S_IRWXG | S_IROTH);
 	if (logid < 0) {
@@ -438,6 +5787,8 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "%s: Can't create log file /tmp/wastebin.log\n", cmdstr);
 		return EXIT_FAILURE;
 	}
+	/* listen before forking, so a client can connect as soon as we return */
+	listenfd = control_listen(cmdstr);
 	pid = fork();
 	if (pid < 0) {
 		fprintf(stderr, "%s: unable to fork\n", cmdstr);
@@ -445,8 +5796,15 @@ int main(int argc, char *argv[])
 	}
 	if (pid > 0) {
 		printf("%s: Forked off a background process to acquire and hold memory\n", cmdstr);
+		if (listenfd >= 0)
+			close(listenfd);
+		if (wait_reply && (listenfd = control_connect()) >= 0) {
+			desired.op = WB_WAIT;
+			return control_exit(listenfd, &desired, cmdstr);
+		}
 		return EXIT_SUCCESS;
 	}
+	wastebin_listen = listenfd;
 	/* now in child, adjust file descriptors in background process to direct output to log file */
 	close(STDIN_FILENO);
 	ec = dup2(logid, STDERR_FILENO);
@@ -466,7 +5824,9 @@ int main(int argc, char *argv[])
 	}
 
 	fprintf(stderr, "%s: Background process started.\n", cmdstr);
-	
+
+serve:
+	catch_terminate(cmdstr);
 	/* open listening pipe. Bu opening for read *and* write, a client
 	 * closing its end of the pipe won't cause an EOF */
 	pipefd = open("/tmp/wastebin", O_RDWR | O_NONBLOCK);
@@ -474,42 +5834,120 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "%s: could not open /tmp/wastebin to read\n", cmdstr);
 		return EXIT_FAILURE;
 	}
-	pipe_poll.fd = pipefd;
-	pipe_poll.events = POLLIN;
-	pipe_poll.revents = 0;
+	wastebin_pipe = pipefd;
 
 	printf("%s: Inventorying currently online cpus and memory\n", cmdstr);
-	inventory_cpus();
+	inventory_cpus(cmdstr);
 	inventory_memory(cmdstr);
+	adopt_handover(cmdstr);
+	inventory_mem_blocks(cmdstr);
+	inventory_memcg(cmdstr);
+	start_release_thread(cmdstr);
+	notify_ready();
 
-
+	current_req = &desired;
+	open_status_page(cmdstr);
+	start_trace(cmdstr);
+	if (open_events() < 0)
+		fail_exit("creating event log", cmdstr);
+	current_gen = ++request_gen;
+	clock_gettime(CLOCK_MONOTONIC, &current_received);
+	if (schedule_nsteps > 0) {
+		printf("%s: running a schedule of %u steps over %.3f s\n", cmdstr,
+		       schedule_nsteps, schedule[schedule_nsteps - 1].at);
+		schedule_start = current_received;
+		schedule_request(0, &desired);
+		current_step = 0;
+		schedule_next = 1;
+	}
+	resolve_request(&desired, &(struct wastebin_request){ 0 }, cmdstr);
+	event_request(current_gen, desired.membytes, desired.cpus);
+	log_event(EV_START, 0, 0, cmdstr);
+	start_setpoint(&desired);
 	while(1) {
+		int reached = 0, early;
+		if (handover_client >= 0 && hand_over(cmdstr)) {
+			/* the memory is the new daemon's, give back everything else and exit */
+			desired = (struct wastebin_request){ .op = WB_EXIT };
+			exit_requested = 1;
+			schedule_next = schedule_nsteps;
+		}
 		printf("%s: disabling %ld cpus and %'ld bytes of memory\n",
 		       cmdstr, desired.cpus, desired.membytes);
-		adjust_cpus(desired.cpus, cmdstr);
-		adjust_memory(desired.membytes, cmdstr);
+		event_request(current_gen, desired.membytes, desired.cpus);
+		log_event(EV_REQUEST, 0, 0, cmdstr);
+		wastebin_idle = 0;
+		trace_adjusting(1);
+		/* with a release thread, give memory back first, it's discarded while cpus change */
+		early = release_async && !desired.per_node &&
+			desired.membytes < wastebin_memory_taken + (ssize_t)wastebin_memory_offline;
+		if (early)
+			reached = adjust_offline(&desired, cmdstr);
+		publish_status(PHASE_CPUS, 0, 0);
+		adjust_cpus(&desired, cmdstr);
+		adjust_burners(&desired, cmdstr);
+		adjust_llc(&desired, cmdstr);
+		adjust_bandwidth(&desired, cmdstr);
+		if (!early)
+			reached = adjust_offline(&desired, cmdstr);
+		trace_adjusting(0);
+
+		/* pick up what came in while adjusting, only the latest request counts */
+		drain_requests(cmdstr);
+		log_step(reached, cmdstr);
+		reply_waiters(current_gen, reached ? WB_APPLIED : WB_SUPERSEDED, &current_received);
+		log_event(reached ? EV_REACHED : EV_SUPERSEDED, 0, elapsed_since(&current_received),
+			  cmdstr);
+		flush_events(cmdstr);
+		wastebin_idle = reached;
+		publish_status(PHASE_IDLE, 0, 0);
 
 		/* don't remain a server if the wastebin is now empty of cpus and memory */
-		if (wastebin_cpus_taken == 0 && wastebin_memory_taken == 0)
+		if (!have_pending && (!wastebin_persistent || exit_requested) &&
+		    wastebin_cpus_taken == 0 && wastebin_memory_taken == 0 &&
+		    wastebin_memory_offline == 0 && wastebin_memory_limited == 0 &&
+		    llc_ways_taken == 0 &&
+		    bandwidth_taken == 0 &&
+		    wastebin_burners == 0 && schedule_next == schedule_nsteps &&
+		    desired.setpoint == SETPOINT_NONE)
 			break;
 		
 		/* get/wait for next client message to change wastebin size */
-		while((nb = read(pipefd, &desired, sizeof(desired)))
-		      != sizeof(desired)) {
-			if (nb > 0 || (nb < 0 && errno != EAGAIN)) {
-				perror("debug");
-				printf("nb %ld errno %d\n", nb, errno);
-				fail_exit("reading client command", cmdstr);
+		while (!drain_requests(cmdstr)) {
+			if (adjust_setpoint(&desired, cmdstr)) {
+				/* only the memory target moved, everything else stays */
+				wastebin_idle = 0;
+				trace_adjusting(1);
+				wastebin_idle = adjust_offline(&desired, cmdstr);
+				trace_adjusting(0);
+				flush_events(cmdstr);
+				publish_status(PHASE_IDLE, 0, 0);
+				continue;
 			}
-			do {
-				ec = poll(&pipe_poll, 1, 50000);
-				if (ec < 0)
-					fail_exit("polling named pipe", cmdstr);
-			} while ((pipe_poll.revents & POLLIN) == 0);
-			pipe_poll.revents = 0;
+			wait_for_request(setpoint_timeout(&desired, 50000), cmdstr);
 		}
+		desired = pending;
+		start_setpoint(&desired);
+		current_step = pending_step;
+		current_gen = pending_gen;
+		current_received = pending_received;
+		have_pending = 0;
 	}
 
+	wait_release();
+	stop_trace();
+	log_event(EV_EXIT, 0, 0, cmdstr);
+	flush_events(cmdstr);
+	if (events_fd >= 0)
+		close(events_fd);
+	close_status_page();
+	for (int i = 0; i < max_clients; i++)
+		if (client_fds[i] >= 0)
+			close_client(i);
+	if (wastebin_listen >= 0) {
+		close(wastebin_listen);
+		unlink(control_socket_path);
+	}
 	close(pipefd);
 	ec = unlink("/tmp/wastebin");
 	if (ec < 0) {
@@ -518,6 +5956,7 @@ int main(int argc, char *argv[])
 	}
 	fprintf(stderr, "%s: background process terminated\n", cmdstr);
 	fflush(stderr);
-	close(logid);
+	if (logid >= 0)
+		close(logid);
 	return EXIT_SUCCESS;
 }